@@ -1,32 +1,42 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <thread>
+
+#ifndef MRTRIX_WINDOWS
+# include <sys/stat.h>
+#endif
+
 #include "command.h"
 #include "file/config.h"
+#include "file/ofstream.h"
+#include "file/path.h"
+#include "file/utils.h"
 #include "image.h"
-#include "algo/loop.h"
-#include "interp/nearest.h"
-#include "interp/linear.h"
-#include "interp/cubic.h"
-#include "filter/reslice.h"
+#include "thread.h"
+#include "timer.h"
 
+#include "daemon.h"
+#include "file_watcher.h"
+#include "parallel.h"
 #include "sixel.h"
+#include "view.h"
 
 using namespace MR;
 using namespace App;
 using namespace VT;
+using namespace MR::Render;
 
-#define DEFAULT_PMIN 0.2
-#define DEFAULT_PMAX 99.8
-
-#define CROSSHAIR_COLOUR 1
-#define STANDARD_COLOUR 2
-#define HIGHLIGHT_COLOUR 3
-#define STATIC_CMAP { {0,0,0}, { 50,50,0 }, {50,50,50}, {100,100,100} }
-
-#define COLOURBAR_WIDTH 10
+#define TILT_INCREMENT (5.0 * Math::pi / 180.0)
 
 vector<std::string> colourmap_choices_std;
 vector<const char*> colourmap_choices_cstr;
-
-enum ArrowMode { ARROW_SLICEVOL, ARROW_COLOUR, ARROW_CROSSHAIR, N_ARROW_MODES };
+const char* roi_shapes[] = { "cube", "sphere", nullptr };
 
 
 // commmand-line description and syntax:
@@ -60,16 +70,86 @@ void usage ()
     + "This requires a terminal capable of displaying sixel graphics (e.g. iTerm2 on macOS, "
     "minTTY on Windows, mlTerm on Linux). Displays the image specified within the terminal, "
     "and allows interacting with the image. Press the ? key while running for runtime usage "
-    "instructions.";
+    "instructions."
+
+    + "To keep the output small, the most common colour in each frame (usually the "
+    "image background) is painted in a single run across each band of six rows, with "
+    "the other colours painted over it. For typical slices, this makes the output "
+    "10-20% smaller than encoding each colour separately; smooth gradients shrink by "
+    "up to half, and noisy images by much less. Setting the MRPeekSixelImplicitBackground "
+    "config file entry to true saves that run as well, leaving these pixels to the "
+    "background fill of the sixel image, but this only makes a small further "
+    "difference. It is disabled by default, since it relies on the terminal filling "
+    "the area of the sixel image with that colour, which not all terminals do: if the "
+    "background is shown in the wrong colour (or not at all) with this setting, leave "
+    "it disabled.";
 
   ARGUMENTS
-  + Argument ("in", "the input image.").type_image_in ();
+  + Argument ("in", "the input image(s). Multiple images are either shown one "
+                    "at a time in interactive mode (switch between them using n / N), "
+                    "or rendered together with the -output_dir option.").type_image_in ().optional().allow_multiple();
 
   OPTIONS
 #ifndef MRTRIX_WINDOWS
   + Option ("batch",
             "disables interactive mode")
 #endif
+  + Option ("output_dir",
+            "render each input image to its own sixel file within the specified folder, "
+            "rather than to the terminal (implies -batch). Images are processed "
+            "concurrently across threads (use -nthreads to control), and throughput "
+            "and per-stage timings are reported once all images have been rendered.")
+  +   Argument ("path").type_directory_out()
+
+  + Option ("input_list",
+            "read the list of input images from the specified text file (one image per "
+            "line), in addition to any supplied as arguments.")
+  +   Argument ("file").type_file_in()
+
+  + Option ("memory_limit",
+            "the maximum amount of memory (in MB) that images being rendered concurrently "
+            "with -output_dir, or held open by the render daemon, are allowed to occupy. "
+            "Default is 2048.")
+  +   Argument ("size").type_integer (1)
+
+#ifndef MRTRIX_WINDOWS
+  + Option ("daemon",
+            "run as a local render server, keeping images and their intensity statistics "
+            "in memory between requests. While the daemon is running, subsequent "
+            "non-interactive invocations of mrpeek hand their rendering over to it. The "
+            "daemon listens on a Unix domain socket, whose location can be set using the "
+            "MRPeekDaemonSocket config file entry.")
+
+  + Option ("daemon_timeout",
+            "exit the render daemon once no requests have been received for the specified "
+            "number of seconds. Default is 600.")
+  +   Argument ("seconds").type_float (0.0)
+
+  + Option ("nodaemon",
+            "render locally, even if a render daemon is running")
+
+  + Option ("watch",
+            "monitor the input image (including any separate data files) for modifications "
+            "(e.g. by a running registration), "
+            "and update the display whenever the voxel data shown have changed, keeping "
+            "the current intensity scaling (interactive mode only).")
+
+  + Option ("record",
+            "record all input received from the terminal during the interactive session "
+            "to the specified file, along with its timing, for later replay using -replay.")
+  +   Argument ("file").type_file_out()
+
+  + Option ("replay",
+            "rather than reading input from the terminal, replay the input recorded "
+            "using -record for the same image(s), discarding the output. Each recorded "
+            "input is processed as soon as the previous one has been, and percentiles of "
+            "the time taken to process it (including the display update that follows) are "
+            "reported, along with the amount of output produced. Computations normally "
+            "performed in the background are performed as required, so that the work "
+            "done for each input is reproducible.")
+  +   Argument ("file").type_file_in()
+#endif
+
   + Option ("sagittal",
             "view sagittal projection only. Default: orthoview")
 
@@ -84,6 +164,13 @@ void usage ()
             "0: L/R (sagittal); 1: A/P (coronal); 2 I/S (axial); 3 volumes... ")
   +   Argument ("number").type_integer(0)
 
+  + Option ("plot_roi",
+            "when plotting along a volume axis, plot the mean \u00B1 standard deviation over "
+            "a region of interest around the focus rather than the values at the focus "
+            "itself. The ROI is a cube or sphere of the specified radius (in voxels).")
+  +   Argument ("radius").type_integer(1)
+  +   Argument ("shape").type_choice (roi_shapes)
+
   + Option ("intensity_range",
             "specify intensity range of the data. The image intensity will be scaled "
             "between the specified minimum and maximum intensity values. "
@@ -103,6 +190,21 @@ void usage ()
             ". Default is " + colourmap_choices_std[0] + ".")
   +   Argument ("name").type_choice (colourmap_choices_cstr.data())
 
+  + Option ("overlay",
+            "overlay the specified image (e.g. a segmentation or statistic map) onto the "
+            "main image, using its own colourmap. The overlay is shown wherever its "
+            "intensity exceeds the threshold (see -overlay_threshold).")
+  +   Argument ("image").type_image_in()
+
+  + Option ("overlay_threshold",
+            "only show the overlay where its intensity exceeds this value. Default is 0.")
+  +   Argument ("value").type_float()
+
+  + Option ("overlay_colourmap",
+            "the colourmap to apply to the overlay; choices are as for -colourmap. "
+            "Default is " + colourmap_choices_std[1] + ".")
+  +   Argument ("name").type_choice (colourmap_choices_cstr.data())
+
   + Option ("focus",
             "set focus (crosshairs) at specified position, as a comma-separated "
             "list of values. Use empty entries to leave as default (e.g. '-focus ,,100' "
@@ -111,13 +213,52 @@ void usage ()
   +   Argument ("pos").type_sequence_float()
 
   + Option ("levels",
-            "number of intensity levels in the colourmap. Default is 32.")
-  +   Argument ("number").type_integer (2)
+            "number of intensity levels in the colourmap. Default is 32, and the maximum "
+            "is " + str(MAX_LEVELS) + " (" + str(MAX_OVERLAY_LEVELS) + " when displaying an overlay).")
+  +   Argument ("number").type_integer (2, MAX_LEVELS)
 
   + Option ("zoom",
             "scale the image size by the supplied factor")
     + Argument ("factor").type_float()
 
+  + Option ("fps",
+            "the frame rate at which to play through volumes (or slices for 3D images) "
+            "in interactive cine mode. Default is 10.")
+    + Argument ("rate").type_float (0.1, 100.0)
+
+  + Option ("lightbox",
+            "show every Nth slice along the slice axis (axial unless otherwise specified) "
+            "as a grid of tiles within a single image.")
+    + Argument ("N").type_integer (1)
+
+  + Option ("volume_grid",
+            "show the current slice of every Nth volume of a 4D image as a grid of "
+            "thumbnails within a single image, with the current volume highlighted.")
+    + Argument ("N").type_integer (1)
+
+  + Option ("projection",
+            "show the maximum, minimum or mean intensity projection of the current "
+            "volume along the slice axis, rather than the slice at the focus. "
+            "Valid choices are: none, max, min, mean. Default is none.")
+    + Argument ("type").type_choice (projection_modes)
+
+  + Option ("temporal",
+            "for 4D images, show a map of the voxel-wise mean, standard deviation or "
+            "temporal signal-to-noise ratio across volumes, rather than the current volume. "
+            "Valid choices are: none, mean, std, tsnr. Default is none.")
+    + Argument ("stat").type_choice (temporal_stat_choices)
+
+  + Option ("rgb",
+            "display the first three volumes along the volume axis as the red, green "
+            "and blue channels of a colour image (e.g. for direction-encoded colour maps). "
+            "Intensity scaling applies equally to all three channels.")
+
+  + Option ("labels",
+            "display the image as integer labels (e.g. a parcellation), each shown in its "
+            "own colour using nearest-neighbour sampling, either as filled regions or "
+            "as their outlines only. Valid choices are: none, fill, outline. Default is none.")
+    + Argument ("mode").type_choice (labels_mode_choices)
+
   + Option ("notext",
             "omit text output to show only the sixel image")
 
@@ -125,438 +266,15 @@ void usage ()
             "do not render crosshairs at the focus")
 
   + Option ("noimage",
-            "do not render the main image");
-}
-
-
-using value_type = float;
-using ImageType = Image<value_type>;
-using Reslicer = Adapter::Reslice<Interp::Nearest, ImageType>;
-using LinearReslicer = Adapter::Reslice<Interp::Linear, ImageType>;
-using CubicReslicer = Adapter::Reslice<Interp::Cubic, ImageType>;
-
-
-
-
-// Global variables to hold slide dislay parameters:
-// These will need to be moved into a struct/class eventually...
-int levels = 32;
-int x_axis, y_axis, slice_axis = 2, plot_axis = slice_axis, vol_axis = -1;
-value_type pmin = DEFAULT_PMIN, pmax = DEFAULT_PMAX, zoom = 1.0;
-bool crosshair = true, colorbar = true, orthoview = true, interactive = true;
-bool do_plot = false, show_image = true, interpolate = false, show_text = true;
-vector<int> focus (3, 0);  // relative to original image grid
-ArrowMode x_arrow_mode = ARROW_SLICEVOL, arrow_mode = x_arrow_mode;
-Sixel::ColourMaps colourmaps;
-Sixel::ColourMaps plot_cmaps;
-
-
-inline std::string move_down (int n) {
-  if (interactive)
-    return move_cursor (Down, n);
-  std::string out;
-  for (int i = 0; i < n; ++i)
-    out += "\n";
-  return out;
-}
-
-
-// calculate percentile of a list of numbers
-// implementation based on `mrthreshold` - can be merged with Math::median in due course
-template <class Container>
-value_type percentile (Container& data, default_type percentile)
-{
-  // ignore nan
-  auto isnotfinite = [](typename Container::value_type val) { return !std::isfinite(val); };
-  data.erase (std::remove_if (data.begin(), data.end(), isnotfinite), data.end());
-  if (percentile == 100.0) {
-    return default_type(*std::max_element (data.begin(), data.end()));
-  } else if (percentile == 0.0) {
-    return default_type(*std::min_element (data.begin(), data.end()));
-  } else {
-    const default_type interp_index = 0.01 * percentile * (data.size()-1);
-    const size_t lower_index = size_t(std::floor (interp_index));
-    const default_type mu = interp_index - default_type(lower_index);
-    std::nth_element (data.begin(), data.begin() + lower_index, data.end());
-    const default_type lower_value = default_type(data[lower_index]);
-    std::nth_element (data.begin(), data.begin() + lower_index + 1, data.end());
-    const default_type upper_value = default_type(data[lower_index + 1]);
-    return (1.0-mu)*lower_value + mu*upper_value;
-  }
-}
-
-
-
-
-
-// Supporting functions for display
-//
-inline void set_axes ()
-{
-  switch (slice_axis) {
-    case 0: x_axis = 1; y_axis = 2; break;
-    case 1: x_axis = 0; y_axis = 2; break;
-    case 2: x_axis = 0; y_axis = 1; break;
-    default: throw Exception ("invalid axis specifier");
-  }
-}
-
-
-
-
-inline std::string show_focus (ImageType& image)
-{
-  image.index(0) = focus[0];
-  image.index(1) = focus[1];
-  image.index(2) = focus[2];
-  std::string out = ClearLine;
-  out += "index: [ ";
-
-  for (int d = 0; d < 3; d++) {
-    if (d == x_axis) {
-      if (arrow_mode == ARROW_CROSSHAIR)
-        out += std::string(LeftRightArrow) + TextForegroundYellow;
-      out += TextUnderscore;
-    }
-    else if (d == y_axis) {
-      if (arrow_mode == ARROW_CROSSHAIR)
-        out += std::string(UpDownArrow) + TextForegroundYellow;
-      out += TextUnderscore;
-    }
-    else {
-      if (arrow_mode == ARROW_SLICEVOL)
-        out += std::string(LeftRightArrow) + TextForegroundYellow;
-    }
-    out += str(focus[d]) + TextReset + " ";
-  }
-  for (int n = 3; n < int(image.ndim()); ++n) {
-    if (n == vol_axis && arrow_mode == ARROW_SLICEVOL)
-      out += std::string(UpDownArrow) + TextForegroundYellow;
-    out += str(image.index(n)) + TextReset + " ";
-  }
-  out += "] ";
-
-  out += "| value: " + str(image.value());
-
-  return out;
-}
-
-
-
-
-inline Reslicer get_regridder (ImageType& image, int with_slice_axis)
-{
-  Header header_target (image);
-  default_type original_extent;
-  for (int d = 0; d < 3; ++d) {
-    const float new_voxel_size = (d == with_slice_axis) ? image.spacing(d) : 1.0f/zoom;
-
-    original_extent = image.size(d) * image.spacing(d);
-
-    header_target.size(d) = std::round (image.size(d) * image.spacing(d) / new_voxel_size - 0.0001); // round down at .5
-    for (size_t i = 0; i < 3; ++i)
-      header_target.transform()(i,3) += 0.5 * (
-          (new_voxel_size - header_target.spacing(d)) +
-          (original_extent - (header_target.size(d) * new_voxel_size))
-          ) * header_target.transform()(i,d);
-    header_target.spacing(d) = new_voxel_size;
-  }
-
-  return { image, header_target };
-}
-
-
-
-
-
-void autoscale (ImageType& image, Sixel::CMap& cmap)
-{
-  auto image_regrid = get_regridder (image, slice_axis);
-  const int x_dim = image_regrid.size(x_axis);
-  const int y_dim = image_regrid.size(y_axis);
-  image_regrid.index(slice_axis) = focus[slice_axis];
-
-  vector<value_type> currentslice (x_dim*y_dim);
-  size_t k = 0;
-  std::cerr.flush();
-  for (auto l = Loop (vector<size_t>({ size_t(x_axis), size_t(y_axis) }))(image_regrid); l; ++l) {
-    //std::cerr << "[" << image_regrid.index(0) << " " << image_regrid.index(1) << " " << image_regrid.index(2) << "] ";
-    currentslice[k++] = image_regrid.value();
-  }
-
-  value_type vmin = percentile(currentslice, pmin);
-  value_type vmax = percentile(currentslice, pmax);
-  cmap.set_scaling_min_max (vmin, vmax);
-  INFO("reset intensity range to " + str(vmin) + " - " +str(vmax));
-}
-
-
-
-
-
-
-// add crosshairs at the specified position,
-// using colour index specified:
-void draw_frame (const Sixel::ViewPort& view, int index)
-{
-  for (int x = 0; x < view.xdim(); ++x)
-    view(x,0) = view(x,view.ydim()-1) = index;
-  for (int y = 0; y < view.ydim(); ++y)
-    view(0,y) = view(view.xdim()-1,y) = index;
-}
-
-
-
-
-
-
-// add crosshairs at the specified position,
-// using colour index specified:
-void draw_crosshairs (const Sixel::ViewPort& view, int x0, int y0, int index) {
-  for (int x = 0; x < view.xdim(); ++x)
-    view(x,y0) = index;
-  for (int y = 0; y < view.ydim(); ++y)
-    view(x0,y) = index;
-}
-
-
-
-
-template <class InterpType>
-void render_slice (InterpType& regrid, const Sixel::ViewPort& view, const Sixel::CMap& cmap)
-{
-  const int x_dim = regrid.size(x_axis);
-  const int y_dim = regrid.size(y_axis);
-
-  regrid.index(slice_axis) = focus[slice_axis];
-  for (int y = 0; y < y_dim; ++y) {
-    regrid.index(y_axis) = y_dim-1-y;
-    for (int x = 0; x < x_dim; ++x) {
-      regrid.index(x_axis) = x_dim-1-x;
-      view(x,y) = cmap (regrid.value());
-    }
-  }
-}
-
-
-
-void display_slice (ImageType& image, Reslicer& regrid, const Sixel::ViewPort& view, const Sixel::CMap& cmap)
-{
-  if (interpolate) {
-    LinearReslicer reslicer (image, regrid);
-    render_slice (reslicer, view, cmap);
-  }
-  else
-    render_slice (regrid, view, cmap);
-}
-
-
-
-void draw_colourbar (const Sixel::ViewPort& view, const Sixel::CMap& cmap)
-{
-  for (int y = 0; y < view.ydim(); ++y) {
-    int colour = cmap.index + std::round (cmap.levels() * (1.0f-float (y)/view.ydim()));
-    for (int x = 0; x < view.xdim(); ++x)
-      view (x,y) = colour;
-  }
-}
-
-
-
-
-
-
-std::string plot (ImageType& image, int plot_axis)
-{
-  set_axes();
-
-  const int radius = std::max<int>(1, std::round(zoom));
-  const int pad = std::max(radius, std::max<int>(2, std::round(2*zoom)));
-  const int x_dim = std::max(100.0, 2.0f * std::max(std::max (image.size(0)*image.spacing(0), image.size(1)*image.spacing(1)), image.size(2)*image.spacing(2)) * zoom) + 2 * pad;
-  const int y_dim = std::round((float) x_dim / 1.618033) + 2 * pad;
-
-  for (int n = 0; n < 3; ++n)
-    image.index(n) = focus[n];
-
-  ssize_t current_index = image.index (plot_axis);
-  image.index(plot_axis) = 0;
-
-  std::vector<value_type> plotslice (image.size(plot_axis));
-  std::vector<value_type> plotslice_finite (image.size(plot_axis));
-  size_t k = 0;
-  for (auto l = Loop (plot_axis)(image); l; ++l) {
-    plotslice[k] = image.value();
-    plotslice_finite[k] = plotslice[k];
-    ++k;
-  }
-  value_type vmin = percentile(plotslice_finite, 0); // non-finite values removed
-  value_type vmax = percentile(plotslice_finite, 100);
-  if (vmax == vmin) {
-    vmin -= 1e-3;
-    vmax += 1e-3;
-  }
-
-  if (!plot_cmaps.size())
-    plot_cmaps.add (STATIC_CMAP);
-
-  Sixel::Encoder encoder (x_dim, y_dim, plot_cmaps);
-  auto canvas = encoder.viewport();
-
-  int last_x, last_y;
-  bool connect_dots = false;
-  const int x_offset = pad, y_offset = y_dim-1-pad;
-  // coordinate axes
-  for (int x = 0; x < x_dim; ++x)
-    canvas(x, y_offset) = HIGHLIGHT_COLOUR;
-  for (int y = 0; y < y_dim; ++y)
-    canvas(x_offset, y) = HIGHLIGHT_COLOUR;
-  for (int index = 0; index < int(plotslice.size()); ++index) {
-    int x = std::round(float(index) / (plotslice.size() - 1) * (x_dim - 2 * pad));
-    assert(x < x_dim);
-    assert(x >= 0);
-    int r0 = (index % 10) == 0 ? -pad : -std::max(1, pad/2);
-    for (int y = r0; y < 0; ++y)
-      canvas(x_offset + x, y_offset - y) = HIGHLIGHT_COLOUR;
-  }
-
-  for (int index = 0; index < int(plotslice.size()); ++index) {
-    // ignore non-finite point, don't connect neighbouring data
-    if (!std::isfinite(plotslice[index])) {
-      connect_dots = false;
-      continue;
-    }
-    int x = std::round(float(index) / (plotslice.size() - 1) * (x_dim - 2 * pad));
-    int y = std::round(float(plotslice[index] - vmin) / (vmax - vmin) * (y_dim - 2 * pad));
-    assert(x < x_dim);
-    assert(x >= 0);
-    assert(y < y_dim);
-    assert(y >= 0);
-
-    if (crosshair && ((plot_axis < 3 && index == focus[plot_axis]) || (plot_axis > 2 && index == current_index))) {
-      // focus position: draw line
-      for (int r = 0; r < y_offset; ++r)
-        canvas (x_offset+x, r) = CROSSHAIR_COLOUR;
-    }
-
-    // plot line segment
-    if (connect_dots) {
-      assert(x > last_x);
-      const int delta_x = x - last_x;
-      const int delta_y = y - last_y;
-      for (int dx = 0; dx <= delta_x; ++dx) {
-        int dy1 = (dx > 0 ) ? std::round (delta_y*(dx-0.5f)/float(delta_x)) : 0;
-        int dy2 = (dx < delta_x) ? std::round (delta_y*(dx+0.5f)/float(delta_x)) : delta_y;
-        if (dy1 > dy2)
-          std::swap (dy1, dy2);
-        for (int ypos = dy1; ypos <= dy2; ++ypos)
-          canvas (x_offset + last_x + dx, y_offset - (last_y + ypos)) = STANDARD_COLOUR;
-      }
-    }
-
-    // data: draw +
-    for (int r = -radius; r <= radius; ++r)
-      canvas(x_offset + x, y_offset - (y+r)) = HIGHLIGHT_COLOUR;
-    for (int r = -radius; r <= radius; ++r)
-      canvas(x_offset + (x + r), y_offset - y) = HIGHLIGHT_COLOUR;
-
-    connect_dots = true;
-    last_x = x; last_y = y;
-  }
-
-  image.index (plot_axis) = current_index;
-
-  // encode buffer and print out:
-  std::string out = move_down (2);
-  if (show_text) out += CarriageReturn + str(vmax) + move_down(1) + CarriageReturn;
-  out += encoder.write();
-  if (show_text) out += ClearLine + str(vmin)
-    + move_down(1) + CarriageReturn + ClearLine
-    + "plot axis: " + str(plot_axis) + " | x range: [ 0 " + str(plotslice.size() - 1) + " ]";
-
-  return out;
-}
-
-
-
-
-
-
-
-
-std::string display_image (ImageType& image, const Sixel::CMap& cmap, int colourbar_offset)
-{
-  std::string out;
-  if (orthoview) {
-    const int backup_slice_axis = slice_axis;
-
-    Reslicer regrid[3] = {
-      get_regridder (image, 0),
-      get_regridder (image, 1),
-      get_regridder (image, 2)
-    };
-
-    // set up canvas:
-    const int panel_y_dim = std::max(regrid[0].size(2), regrid[2].size(1));
-    Sixel::Encoder encoder (colourbar_offset + regrid[0].size(1)+regrid[1].size(0)+regrid[2].size(0),
-        panel_y_dim, colourmaps);
-
-    if (colorbar) draw_colourbar (encoder.viewport (0, 0, COLOURBAR_WIDTH), cmap);
-
-
-    int x_pos = colourbar_offset;
-    for (slice_axis = 0; slice_axis < 3; ++slice_axis) {
-      set_axes();
-      const int x_dim = regrid[slice_axis].size (x_axis);
-      const int y_dim = regrid[slice_axis].size (y_axis);
-      // recentring
-      const int dy = (panel_y_dim - y_dim) / 2;
-      auto view = encoder.viewport (x_pos, 0, regrid[slice_axis].size (x_axis), panel_y_dim);
-      display_slice (image, regrid[slice_axis], view.viewport (0, dy), cmap);
-
-      if (crosshair) {
-        int x = std::round(x_dim - image.spacing(x_axis) * (focus[x_axis] + 0.5) * zoom);
-        int y = std::round(y_dim - image.spacing(y_axis) * (focus[y_axis] + 0.5) * zoom);
-        x = std::max (std::min (x, x_dim-1), 0);
-        y = std::max (std::min (y, y_dim-1), 0);
-        draw_crosshairs (view, x, y+dy, CROSSHAIR_COLOUR);
-      }
-
-      if (interactive && slice_axis == backup_slice_axis)
-        draw_frame (view, HIGHLIGHT_COLOUR);
-
-      x_pos += regrid[slice_axis].size (x_axis);
-    }
-    slice_axis = backup_slice_axis;
-    set_axes();
-
-    // encode buffer and print out:
-    out += encoder.write();
-  }
-  else {
-    auto regrid = get_regridder (image, slice_axis);
-    const int x_dim = regrid.size (x_axis);
-    const int y_dim = regrid.size (y_axis);
-
-    Sixel::Encoder encoder (colourbar_offset+x_dim, y_dim, colourmaps);
-    if (colorbar) draw_colourbar (encoder.viewport (0, 0, COLOURBAR_WIDTH), cmap);
-
-    auto view = encoder.viewport(colourbar_offset, 0);
-    display_slice (image, regrid, view, cmap);
-
-    if (crosshair) {
-      int x = std::round(x_dim - image.spacing(x_axis) * (focus[x_axis] + 0.5) * zoom);
-      int y = std::round(y_dim - image.spacing(y_axis) * (focus[y_axis] + 0.5) * zoom);
-      x = std::max (std::min (x, x_dim-1), 0);
-      y = std::max (std::min (y, y_dim-1), 0);
-      draw_crosshairs (view, x, y, CROSSHAIR_COLOUR);
-    }
-
-    //view.draw_colourbar ();
-
-    // encode buffer and print out:
-    out += encoder.write();
-  }
-  return out;
+            "do not render the main image")
+
+  + Option ("profile",
+            "write the time taken by each stage of rendering every frame (resampling, "
+            "rendering, intensity scaling, sixel encoding and output to the terminal) "
+            "to the specified file, in the Chrome trace event format (as shown by "
+            "chrome://tracing or https://ui.perfetto.dev). The timings of the last "
+            "frame can also be shown interactively by pressing S.")
+    + Argument ("file").type_file_out();
 }
 
 
@@ -564,62 +282,6 @@ std::string display_image (ImageType& image, const Sixel::CMap& cmap, int colour
 
 
 
-// Show the main image,
-// run repeatedly to update display.
-std::string display (ImageType& image, Sixel::ColourMaps& colourmaps)
-{
-  std::string out;
-  auto& cmap = colourmaps[1];
-
-  if (show_image) {
-    set_axes();
-    for (int n = 0; n < 3; ++n) {
-      if (focus[n] < 0) focus[n] = 0;
-      if (focus[n] >= image.size(n)) focus[n] = image.size(n)-1;
-    }
-
-    if (!cmap.scaling_set())
-      autoscale (image, cmap);
-    if (show_text) {
-      out += ClearLine;
-      if (arrow_mode == ARROW_COLOUR)
-        out += TextForegroundYellow;
-      out += str(cmap.max(),4) + TextReset + move_down(1) + position_cursor_at_col (2);
-    }
-
-    out += display_image (image, cmap, 2*COLOURBAR_WIDTH) + CarriageReturn + ClearLine;
-
-    if (show_text) {
-      if (arrow_mode == ARROW_COLOUR)
-        out += TextForegroundYellow;
-      out += str(cmap.min(), 4) + TextReset + move_down(1) + CarriageReturn;
-    }
-  }
-
-
-  if (show_text) out += show_focus(image);
-
-  if (interactive && orthoview && show_text) {
-    out += " | active: ";
-    switch (slice_axis) {
-      case (0): out += std::string (TextUnderscore) + "s" + TextReset + "agittal"; break;
-      case (1): out += std::string (TextUnderscore) + "c" + TextReset + "oronal"; break;
-      case (2): out += std::string (TextUnderscore) + "a" + TextReset + "xial"; break;
-      default: break;
-    };
-  }
-
-  if (interactive && show_text)
-    out += std::string(" | help: ") + TextUnderscore + "?" + TextReset;
-  if (do_plot)
-    out += plot (image, plot_axis);
-
-  return out;
-}
-
-
-
-
 
 
 
@@ -645,6 +307,12 @@ void show_help ()
     + key ("left/right", "previous/next volume")
     + key ("a / s / c", "axial / sagittal / coronal projection")
     + key ("o", "toggle orthoview")
+    + key ("L", "select lightbox slice spacing")
+    + key ("G", "select volume grid spacing (4D images)")
+    + key ("P", "cycle through maximum / minimum / mean intensity projection")
+    + key ("C", "toggle RGB display of first 3 volumes (4D images)")
+    + key ("E", "cycle label display: off, filled, outlines")
+    + key ("T", "cycle through temporal mean / std / tSNR (4D images)")
     + key ("m", "toggle image display")
     + key ("t", "toggle text overlay")
     + key ("v", "choose volume dimension")
@@ -656,10 +324,18 @@ void show_help ()
     + key ("i", "toggle between nearest (default) and linear interpolation")
     + key ("left mouse & drag", "move focus")
     + key ("right mouse & drag", "adjust brightness / contrast")
+    + key ("middle mouse & drag", "tilt slicing plane (oblique view)")
+    + key ("[ / ] and { / }", "tilt slicing plane left/right and up/down")
+    + key ("0", "reset slicing plane tilt")
     + key ("Esc", "reset brightness / contrast")
     + key ("1-9", "select colourmap")
     + key ("l", "select number of colourmap levels")
     + key ("p", "intensity plot along specified axis")
+    + key ("R", "select radius of ROI averaged over in volume plots")
+    + key ("n / N", "next / previous image (multiple images)")
+    + key (">", "play through volumes (or slices for 3D images) / stop")
+    + key ("F", "select frame rate for playback")
+    + key ("S", "show / hide rendering timings, frame size & rate")
     + move_cursor(Down,1)
     + key ("q / Q / Crtl-C", "exit mrpeek")
     + move_cursor(Down,1)
@@ -733,135 +409,606 @@ bool query_int (const std::string& prompt,
 
 
 
-class CallBack : public EventLoop::CallBack
+// The images passed on the command line, flipped between interactively.
+// While one image is shown, its neighbours in the list are opened and
+// rendered on a background thread, using a copy of the current view carried
+// over to them. Switching to an image that was prefetched for the current
+// view then only involves writing out its frame; if the view has changed
+// since, the image is at least already open. Without 'background' (e.g. when
+// replaying recorded input, so that the timings do not depend on that of the
+// thread), nothing is prefetched, and images are opened and rendered once
+// selected.
+class ImageSession
 {
   public:
-    CallBack (ImageType& image) : image (image), xp (0), yp (0), need_update (true) { }
+    ImageSession (const vector<std::string>& paths, bool keep_scaling, bool background) :
+      paths (paths), keep_scaling (keep_scaling), index (0), quit (false)
+    {
+      if (background)
+        thread = std::thread (&ImageSession::run, this);
+    }
 
-    bool operator() (int event, const std::vector<int>& param) override
+    ~ImageSession () {
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        quit = true;
+      }
+      condition.notify_all();
+      if (thread.joinable())
+        thread.join();
+    }
+
+    size_t size () const { return paths.size(); }
+    size_t current () const { return index; }
+    const std::string& path (size_t n) const { return paths[n]; }
+
+    // switch to image n, carrying 'view' over from the current 'image',
+    // which is replaced. Returns the frame pre-rendered for the resulting
+    // view, or an empty string if there is none. If image n cannot be
+    // opened, the exception is passed on with the current image and the
+    // session left unchanged:
+    std::string select (size_t n, View& view, ImageType& image)
     {
+      std::unique_lock<std::mutex> lock (mutex);
+      Entry entry;
+      auto it = entries.find (n);
+      if (it != entries.end())
+        entry = it->second;
+      lock.unlock();
+
+      if (!entry.image.valid())
+        entry.image = ImageType::open (paths[n]);
+
+      lock.lock();
+      const std::string key = view.state_key (image);
+      entries.erase (n);
+      entries[index] = { image, std::string(), std::string(), View() };
+      index = n;
+      request_key.clear();
+      lock.unlock();
+
+      view.switch_image (image, entry.image);
+      view.caption = caption (n);
+      image = entry.image;
+
+      if (entry.frame.size() && entry.key == key) {
+        if (!keep_scaling)
+          view.colourmaps[1].set_scaling (entry.view.colourmaps[1].offset(), entry.view.colourmaps[1].scale());
+        view.projections = entry.view.projections;
+        view.temporal_stats = entry.view.temporal_stats;
+        return entry.frame;
+      }
+      if (!keep_scaling)
+        view.colourmaps[1].invalidate_scaling();
+      return std::string();
+    }
 
-      if (!event) {
-        if (need_update) {
-          need_update = false;
-          std::cout << CursorHome << display (image, colourmaps);
-          std::cout.flush();
-        }
-        return true;;
+    // prefetch the neighbours of the current image for 'view', if not
+    // already done for the same view:
+    void prefetch (const View& view, const ImageType& image)
+    {
+      if (!thread.joinable())
+        return;
+      const std::string key = view.state_key (image);
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        if (key == request_key)
+          return;
+        request_key = key;
+        request = view;
+        request.background = false;
+        request.timeseries = nullptr;
+        request.roi_stats = nullptr;
+        request.projections = nullptr;
+        request.temporal_stats = nullptr;
+        request.profiler = nullptr;
+        request_image = image;
       }
+      condition.notify_all();
+    }
 
-      need_update = true;
+    std::string caption (size_t n) const {
+      return "image " + str(n+1) + " of " + str(paths.size()) + ": " + Path::basename (paths[n]);
+    }
 
-      if (event == 'q')
+  private:
+    struct Entry {
+      ImageType image;
+      std::string key, frame;  // frame pre-rendered for view with state 'key'
+      View view;  // view as rendered, holding the scaling and cached data
+    };
+
+    const vector<std::string> paths;
+    const bool keep_scaling;
+    size_t index;
+    std::map<size_t,Entry> entries;
+    View request;
+    ImageType request_image;
+    std::string request_key;
+    bool quit;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread thread;
+
+    // next neighbour of the current image that is not prefetched for the
+    // current request, if any:
+    bool next_pending (size_t& n) const
+    {
+      if (request_key.empty() || paths.size() < 2)
         return false;
+      for (size_t candidate : { (index + 1) % paths.size(), (index + paths.size() - 1) % paths.size() }) {
+        auto it = entries.find (candidate);
+        if (it == entries.end() || it->second.key != request_key) {
+          n = candidate;
+          return true;
+        }
+      }
+      return false;
+    }
 
-      if (event == MouseEvent) {
-        auto button = mouse_button (param[0]);
-        bool mod = mouse_modifier (param[0]);
-        int x = param[1];
-        int y = param[2];
+    void run ()
+    {
+      std::unique_lock<std::mutex> lock (mutex);
+      while (!quit) {
+        size_t n;
+        if (!next_pending (n)) {
+          condition.wait (lock);
+          continue;
+        }
 
-        if (x-xp > 127) xp += 256;
-        if (xp-x > 127) xp -= 256;
-        if (y-yp > 127) yp += 256;
-        if (yp-y > 127) yp -= 256;
+        // only the neighbours of the current image are kept:
+        for (auto it = entries.begin(); it != entries.end();) {
+          const size_t d = (it->first + paths.size() - index) % paths.size();
+          if (d != 1 && d != paths.size()-1)
+            it = entries.erase (it);
+          else
+            ++it;
+        }
 
-        switch (button) {
-          case MouseWheelUp:
-            focus[slice_axis] += mod ? 10 : 1;
-            break;
-          case MouseWheelDown:
-            focus[slice_axis] -= mod ? 10 : 1;
-            break;
-          case MouseMoveLeft:
-            focus[x_axis] += xp-x;
-            focus[y_axis] += yp-y;
-            break;
-          case MouseMoveRight:
-            colourmaps[1].update_scaling (x-xp, y-yp);
-            break;
-          default: break;
+        Entry entry;
+        auto it = entries.find (n);
+        if (it != entries.end())
+          entry.image = it->second.image;
+        entry.key = request_key;
+        entry.view = request;
+        ImageType from (request_image);
+        lock.unlock();
+
+        try {
+          if (!entry.image.valid())
+            entry.image = ImageType::open (paths[n]);
+          entry.view.switch_image (from, entry.image);
+          entry.view.caption = caption (n);
+          if (!keep_scaling)
+            entry.view.colourmaps[1].invalidate_scaling();
+          std::ostringstream frame;
+          entry.view.display (frame, entry.image);
+          if (entry.view.complete())
+            entry.frame = frame.str();
+        }
+        catch (Exception& e) {
+          // leave the error to be reported if the image is selected:
+          entry.image = ImageType();
         }
 
-        xp = x;
-        yp = y;
-        return true;
+        lock.lock();
+        // the request may have changed while rendering, in which case
+        // the image is kept, but the frame needs to be rendered again:
+        if (entry.key != request_key)
+          entry.key.clear();
+        entries[n] = entry;
       }
+    }
+};
 
-      switch (event) {
-        case Up:
-          switch(arrow_mode) {
-            case ARROW_SLICEVOL:  ++focus[slice_axis];   break;
-            case ARROW_CROSSHAIR: ++focus[y_axis]; break;
-            case ARROW_COLOUR:    colourmaps[1].update_scaling (0, -1); break;
-            default: break;
-          } break;
-        case Down:
-          switch(arrow_mode) {
-            case ARROW_SLICEVOL:  --focus[slice_axis];   break;
-            case ARROW_CROSSHAIR: --focus[y_axis]; break;
-            case ARROW_COLOUR:    colourmaps[1].update_scaling (0, 1); break;
-            default: break;
-          } break;
-        case Left:
-          switch(arrow_mode) {
-            case ARROW_SLICEVOL:  if (vol_axis >= 0) {
-                                    --image.index(vol_axis);
-                                    if (image.index(vol_axis) < 0) image.index(vol_axis) = image.size(vol_axis) - 1; }
-                                  break;
-            case ARROW_CROSSHAIR: ++focus[x_axis]; break;
-            case ARROW_COLOUR:    colourmaps[1].update_scaling (-1, 0); break;
-            default: break;
-          } break;
-        case Right:
-          switch(arrow_mode) {
-            case ARROW_SLICEVOL:  if (vol_axis >= 0) {
-                                    ++image.index(vol_axis);
-                                    if (image.index(vol_axis) >= image.size(vol_axis)) image.index(vol_axis) = 0; }
-                                  break;
-            case ARROW_CROSSHAIR: --focus[x_axis]; break;
-            case ARROW_COLOUR:    colourmaps[1].update_scaling (1, 0); break;
-            default: break;
-          } break;
-        case 'f': crosshair = !crosshair; break;
-        case 'v': if (image.ndim() > 3) {vol_axis = (vol_axis - 2) % (image.ndim() - 3) + 3; } break;
-        case 'a': slice_axis = 2; if (!orthoview) std::cout << ClearScreen; break;
-        case 's': slice_axis = 0; if (!orthoview) std::cout << ClearScreen; break;
-        case 'c': slice_axis = 1; if (!orthoview) std::cout << ClearScreen; break;
-        case 'o': orthoview = !orthoview; std::cout << ClearScreen; break;
-        case 't': show_text = colorbar = !show_text; std::cout << ClearScreen; break;
-        case 'm': show_image = !show_image; std::cout << ClearScreen; break;
-        case 'r': focus[x_axis] = std::round (image.size(x_axis)/2); focus[x_axis] = std::round (image.size(x_axis)/2);
-                  focus[slice_axis] = std::round (image.size(slice_axis)/2); break;
-        case 'i': interpolate = !interpolate; break;
-        case '+': zoom *= 1.1; std::cout << ClearScreen; break;
-        case '-': zoom /= 1.1; std::cout << ClearScreen; break;
-        case ' ':
-        case 'x': arrow_mode = x_arrow_mode = (x_arrow_mode == ARROW_SLICEVOL) ? ARROW_CROSSHAIR : ARROW_SLICEVOL; break;
-        case 'b': arrow_mode = (arrow_mode == ARROW_COLOUR) ? x_arrow_mode : ARROW_COLOUR; break;
-        case Escape: colourmaps[1].invalidate_scaling(); break;
-        case 'l': {
-                    int n;
-                    if (query_int ("select number of levels: ", n, 1, 254)) {
-                      levels = n;
-                      colourmaps[1].set_levels (levels);
-                    }
-                  } break;
-        case 'p': do_plot = query_int ("select plot axis [0 ... "+str(image.ndim()-1)+"]: ",
-                      plot_axis, 0, image.ndim()-1);
-                  if (!do_plot) std::cout << ClearScreen;
-                  break;
-        case '?': show_help(); break;
 
-        default:
-                  if (event >= '1' && event <= '9') {
-                    size_t idx = event - '1';
-                    if (idx < colourmap_choices_std.size()) {
-                      colourmaps[1].ID = idx;
-                      break;
-                    }
-                  }
-                  /* for debugging purposes:
+
+
+
+
+
+// Playback through the volumes of an image (or its slices if 3D) at a fixed
+// frame rate. A producer thread renders frames ahead of time into a ring
+// buffer, using its own copy of the view, while a writer thread paces their
+// output to the terminal. Frames that are already overdue when they could be
+// shown are dropped, and not rendered in the first place where possible, so
+// that playback keeps to time rather than building up latency when
+// rendering or the terminal cannot keep up.
+class CinePlayer
+{
+  public:
+    CinePlayer (const View& current, const ImageType& image) :
+      view (current), image (image),
+      axis (current.vol_axis >= 0 ? current.vol_axis : current.slice_axis),
+      start (current.vol_axis >= 0 ? image.index (axis) : current.focus[axis]),
+      interval (1.0 / current.frame_rate),
+      head (0), tail (0), shown (start), ndropped (0), started (false), stop (false)
+    {
+      //CONF option: MRPeekCineFrames
+      //CONF default: 8
+      //CONF the number of frames rendered ahead of time during cine playback.
+      ring.resize (std::max (1, File::Config::get_int ("MRPeekCineFrames", 8)));
+      view.background = false;
+      view.timeseries = nullptr;
+      view.roi_stats = nullptr;
+      view.projections = nullptr;
+      view.temporal_stats = nullptr;
+      view.caption += std::string (view.caption.size() ? " | " : "") + "playing at "
+        + str(current.frame_rate, 3) + " fps (any key to stop)";
+      producer = std::thread (&CinePlayer::produce, this);
+      writer = std::thread (&CinePlayer::write, this);
+    }
+
+    ~CinePlayer () {
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        stop = true;
+      }
+      condition.notify_all();
+      producer.join();
+      writer.join();
+    }
+
+    // the volume (or slice) along the playback axis last shown:
+    int position () const { return shown; }
+    int playback_axis () const { return axis; }
+    size_t dropped () const { return ndropped; }
+
+  private:
+    using clock = std::chrono::steady_clock;
+    struct Frame {
+      size_t number;
+      std::string data;
+    };
+
+    View view;
+    ImageType image;
+    const int axis, start;
+    const std::chrono::duration<double> interval;
+    vector<Frame> ring;
+    size_t head, tail;  // number of frames added to & removed from the ring
+    std::atomic<int> shown;
+    std::atomic<size_t> ndropped;
+    bool started, stop;
+    clock::time_point t0;  // time at which the first frame was shown
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread producer, writer;
+
+    clock::time_point due (size_t number) const {
+      return t0 + std::chrono::duration_cast<clock::duration> (interval * double (number));
+    }
+
+    void produce ()
+    {
+      size_t number = 0;
+      std::unique_lock<std::mutex> lock (mutex);
+      while (true) {
+        condition.wait (lock, [&] { return stop || head - tail < ring.size(); });
+        if (stop)
+          return;
+        // skip frames that would already be overdue:
+        if (started) {
+          const size_t now = (clock::now() - t0) / interval;
+          number = std::max (number, now + 1);
+        }
+        lock.unlock();
+
+        const int index = (start + number) % image.size (axis);
+        if (view.vol_axis >= 0)
+          image.index (axis) = index;
+        else
+          view.focus[axis] = index;
+        std::ostringstream out;
+        out << CursorHome;
+        view.display (out, image);
+
+        lock.lock();
+        ring[head++ % ring.size()] = { number++, out.str() };
+        condition.notify_all();
+      }
+    }
+
+    void write ()
+    {
+      std::unique_lock<std::mutex> lock (mutex);
+      while (true) {
+        condition.wait (lock, [&] { return stop || head > tail; });
+        if (stop)
+          return;
+        Frame frame;
+        std::swap (frame, ring[tail++ % ring.size()]);
+        condition.notify_all();
+
+        if (!started) {
+          t0 = clock::now() - std::chrono::duration_cast<clock::duration> (interval * double (frame.number));
+          started = true;
+        }
+        if (clock::now() > due (frame.number+1)) {
+          ++ndropped;
+          continue;
+        }
+        if (condition.wait_until (lock, due (frame.number), [&] { return stop; }))
+          return;
+
+        lock.unlock();
+        {
+          Profile::Timer timer (view.profiler.get(), Profile::FLUSH);
+          std::cout << frame.data;
+          std::cout.flush();
+        }
+        if (view.profiler)
+          view.profiler->finish (frame.data.size());
+        shown = (start + frame.number) % image.size (axis);
+        lock.lock();
+      }
+    }
+};
+
+
+
+
+
+
+
+// write the frame rendered by 'view' to the terminal, or the pre-rendered
+// 'frame' if not empty. When profiling, the frame is rendered in full before
+// being written out, so that the time taken by the terminal is accounted
+// for separately:
+void show_frame (View& view, ImageType& image, const std::string& frame = std::string())
+{
+  Profile::Profiler* profiler = view.profiler.get();
+  if (!profiler && frame.empty()) {
+    view.display (std::cout, image);
+    std::cout.flush();
+    return;
+  }
+
+  std::string data (frame);
+  if (data.empty()) {
+    std::ostringstream out;
+    view.display (out, image);
+    data = out.str();
+  }
+  {
+    Profile::Timer timer (profiler, Profile::FLUSH);
+    std::cout << data;
+    std::cout.flush();
+  }
+  if (profiler)
+    profiler->finish (data.size());
+}
+
+
+
+
+
+
+
+class CallBack : public EventLoop::CallBack
+{
+  public:
+    CallBack (View& view, ImageType& image, ImageSession* session = nullptr) :
+      EventLoop::CallBack (true), view (view), image (image), session (session), xp (0), yp (0), need_update (true) { }
+
+    bool operator() (int event, const std::vector<int>& param) override
+    {
+
+      // any input stops playback, carrying the position reached back to the view:
+      if (cine && event && event != WakeUp) {
+        if (view.vol_axis >= 0)
+          image.index (cine->playback_axis()) = cine->position();
+        else
+          view.focus[cine->playback_axis()] = cine->position();
+        DEBUG ("cine playback: " + str(cine->dropped()) + " frames dropped");
+        cine.reset();
+        need_update = true;
+        if (event == '>')
+          return true;
+      }
+
+      if (event == WakeUp) {
+        // a modification of the watched image only requires an update if
+        // the data shown have changed, and progress of a background
+        // computation only if the last frame was waiting on it:
+        bool changed = false;
+        if (watcher && watcher->changes() != changes_seen) {
+          changes_seen = watcher->changes();
+          changed = reload();
+        }
+        need_update = need_update || changed || !view.complete();
+        return true;
+      }
+
+      if (!event) {
+        // during playback, the display is updated by the player:
+        if (need_update && !cine) {
+          need_update = false;
+          std::cout << CursorHome;
+          show_frame (view, image, frame);
+          frame.clear();
+          if (session)
+            session->prefetch (view, image);
+          if (watcher) {
+            const std::string key = view.state_key (image);
+            if (key != checksum_key) {
+              checksum_key = key;
+              checksum = view.checksum (image);
+            }
+          }
+        }
+        return true;;
+      }
+
+      need_update = true;
+
+      if (event == 'q')
+        return false;
+
+      if (event == MouseEvent) {
+        auto button = mouse_button (param[0]);
+        bool mod = mouse_modifier (param[0]);
+        int x = param[1];
+        int y = param[2];
+
+        if (x-xp > 127) xp += 256;
+        if (xp-x > 127) xp -= 256;
+        if (y-yp > 127) yp += 256;
+        if (yp-y > 127) yp -= 256;
+
+        switch (button) {
+          case MouseWheelUp:
+            view.focus[view.slice_axis] += mod ? 10 : 1;
+            break;
+          case MouseWheelDown:
+            view.focus[view.slice_axis] -= mod ? 10 : 1;
+            break;
+          case MouseMoveLeft:
+            view.focus[view.x_axis] += xp-x;
+            view.focus[view.y_axis] += yp-y;
+            break;
+          case MouseMoveRight:
+            view.colourmaps[1].update_scaling (x-xp, y-yp);
+            break;
+          case MouseMoveMiddle:
+            view.tilt[0] += TILT_INCREMENT * (y-yp) / 5.0;
+            view.tilt[1] += TILT_INCREMENT * (x-xp) / 5.0;
+            break;
+          default: break;
+        }
+
+        xp = x;
+        yp = y;
+        return true;
+      }
+
+      switch (event) {
+        case Up:
+          switch(view.arrow_mode) {
+            case ARROW_SLICEVOL:  ++view.focus[view.slice_axis];   break;
+            case ARROW_CROSSHAIR: ++view.focus[view.y_axis]; break;
+            case ARROW_COLOUR:    view.colourmaps[1].update_scaling (0, -1); break;
+            default: break;
+          } break;
+        case Down:
+          switch(view.arrow_mode) {
+            case ARROW_SLICEVOL:  --view.focus[view.slice_axis];   break;
+            case ARROW_CROSSHAIR: --view.focus[view.y_axis]; break;
+            case ARROW_COLOUR:    view.colourmaps[1].update_scaling (0, 1); break;
+            default: break;
+          } break;
+        case Left:
+          switch(view.arrow_mode) {
+            case ARROW_SLICEVOL:  if (view.vol_axis >= 0) {
+                                    --image.index(view.vol_axis);
+                                    if (image.index(view.vol_axis) < 0) image.index(view.vol_axis) = image.size(view.vol_axis) - 1; }
+                                  break;
+            case ARROW_CROSSHAIR: ++view.focus[view.x_axis]; break;
+            case ARROW_COLOUR:    view.colourmaps[1].update_scaling (-1, 0); break;
+            default: break;
+          } break;
+        case Right:
+          switch(view.arrow_mode) {
+            case ARROW_SLICEVOL:  if (view.vol_axis >= 0) {
+                                    ++image.index(view.vol_axis);
+                                    if (image.index(view.vol_axis) >= image.size(view.vol_axis)) image.index(view.vol_axis) = 0; }
+                                  break;
+            case ARROW_CROSSHAIR: --view.focus[view.x_axis]; break;
+            case ARROW_COLOUR:    view.colourmaps[1].update_scaling (1, 0); break;
+            default: break;
+          } break;
+        case 'f': view.crosshair = !view.crosshair; break;
+        case 'v': if (image.ndim() > 3) {view.vol_axis = (view.vol_axis - 2) % (image.ndim() - 3) + 3; } break;
+        case 'a': view.slice_axis = 2; if (!view.orthoview) std::cout << ClearScreen; break;
+        case 's': view.slice_axis = 0; if (!view.orthoview) std::cout << ClearScreen; break;
+        case 'c': view.slice_axis = 1; if (!view.orthoview) std::cout << ClearScreen; break;
+        case 'o': view.orthoview = !view.orthoview; std::cout << ClearScreen; break;
+        case 't': view.show_text = view.colorbar = !view.show_text; std::cout << ClearScreen; break;
+        case 'm': view.show_image = !view.show_image; std::cout << ClearScreen; break;
+        case 'r': view.focus[view.x_axis] = std::round (image.size(view.x_axis)/2); view.focus[view.x_axis] = std::round (image.size(view.x_axis)/2);
+                  view.focus[view.slice_axis] = std::round (image.size(view.slice_axis)/2); break;
+        case 'i': view.interpolate = !view.interpolate; break;
+        case '[': view.tilt[1] -= TILT_INCREMENT; break;
+        case ']': view.tilt[1] += TILT_INCREMENT; break;
+        case '{': view.tilt[0] -= TILT_INCREMENT; break;
+        case '}': view.tilt[0] += TILT_INCREMENT; break;
+        case '0': view.tilt[0] = view.tilt[1] = 0.0f; break;
+        case '+': view.zoom *= 1.1; std::cout << ClearScreen; break;
+        case '-': view.zoom /= 1.1; std::cout << ClearScreen; break;
+        case ' ':
+        case 'x': view.arrow_mode = view.x_arrow_mode = (view.x_arrow_mode == ARROW_SLICEVOL) ? ARROW_CROSSHAIR : ARROW_SLICEVOL; break;
+        case 'b': view.arrow_mode = (view.arrow_mode == ARROW_COLOUR) ? view.x_arrow_mode : ARROW_COLOUR; break;
+        case Escape: view.colourmaps[1].invalidate_scaling(); break;
+        case 'l': {
+                    int n;
+                    if (query_int ("select number of levels: ", n, 1, view.overlay.valid() ? MAX_OVERLAY_LEVELS : MAX_LEVELS))
+                      view.set_levels (n);
+                  } break;
+        case 'L': if (!query_int ("select lightbox slice spacing (empty to disable): ", view.lightbox, 1))
+                    view.lightbox = 0;
+                  std::cout << ClearScreen;
+                  break;
+        case 'G': if (!query_int ("select volume grid spacing (empty to disable): ", view.volume_grid, 1))
+                    view.volume_grid = 0;
+                  std::cout << ClearScreen;
+                  break;
+        case 'T': if (view.vol_axis >= 0) {
+                    view.temporal = TemporalStat ((view.temporal + 1) % N_TEMPORAL_STATS);
+                    view.colourmaps[1].invalidate_scaling();
+                  } break;
+        case 'C': view.rgb = !view.rgb; break;
+        case 'E': view.labels_mode = LabelsMode ((view.labels_mode + 1) % N_LABELS_MODES); break;
+        case 'P': view.projection = ProjectionMode ((view.projection + 1) % N_PROJECTION_MODES);
+                  view.colourmaps[1].invalidate_scaling();
+                  break;
+        case 'R': if (!query_int ("select plot ROI radius (empty to disable): ", view.plot_roi, 1))
+                    view.plot_roi = 0;
+                  std::cout << ClearScreen;
+                  break;
+        case 'p': view.do_plot = query_int ("select plot axis [0 ... "+str(image.ndim()-1)+"]: ",
+                      view.plot_axis, 0, image.ndim()-1);
+                  if (!view.do_plot) std::cout << ClearScreen;
+                  break;
+        case 'n':
+        case 'N': if (session) {
+                    const size_t n = (session->current() + (event == 'n' ? 1 : session->size()-1)) % session->size();
+                    try {
+                      frame = session->select (n, view, image);
+                    }
+                    catch (Exception& e) {
+                      // stay on the current image, reporting the error in the status line:
+                      view.caption = session->caption (session->current()) + " - unable to open " + Path::basename (session->path (n));
+                      DEBUG ("error opening image: " + e.description[0]);
+                    }
+                    std::cout << ClearScreen;
+                  } break;
+        case '>': if ((view.vol_axis >= 0 ? image.size (view.vol_axis) : image.size (view.slice_axis)) > 1)
+                    cine.reset (new CinePlayer (view, image));
+                  need_update = false;
+                  break;
+        case 'F': {
+                    int fps;
+                    if (query_int ("select cine frame rate (frames per second): ", fps, 1, 100))
+                      view.frame_rate = fps;
+                  } break;
+        case 'S': view.show_profile = !view.show_profile;
+                  if (view.show_profile && !view.profiler)
+                    view.profiler = std::make_shared<Profile::Profiler>();
+                  else if (!view.show_profile && !view.profiler->tracing())
+                    view.profiler = nullptr;
+                  std::cout << ClearScreen;
+                  break;
+        case '?': show_help(); break;
+
+        default:
+                  if (event >= '1' && event <= '9') {
+                    size_t idx = event - '1';
+                    if (idx < colourmap_choices_std.size()) {
+                      view.colourmaps[1].ID = idx;
+                      break;
+                    }
+                  }
+                  /* for debugging purposes:
                   std::cerr << std::hex << event << " ( ";
                   for (const auto x : param)
                     std::cerr << x << " ";
@@ -874,117 +1021,883 @@ class CallBack : public EventLoop::CallBack
     }
 
 
+    // update the display when the image at 'path' is modified:
+    void watch (const FileWatcher* file_watcher, const std::string& path) {
+      watcher = file_watcher;
+      watch_path = path;
+    }
+
   private:
+    View& view;
     ImageType& image;
+    ImageSession* session;
+    std::string frame;  // pre-rendered frame to show instead of rendering the view
     int xp, yp;
     bool need_update;
+
+    std::unique_ptr<CinePlayer> cine;  // only set during playback
+
+    const FileWatcher* watcher = nullptr;
+    std::string watch_path, checksum_key;
+    size_t changes_seen = 0;
+    uint64_t checksum = 0;  // of the data shown, for the view with state 'checksum_key'
+
+    // re-open the watched image, and return whether the data shown have
+    // changed. Only the header is parsed on opening, and only the slices
+    // shown are read to compare against. The intensity scaling is kept
+    // unless the image dimensions have changed:
+    bool reload ()
+    {
+      ImageType updated;
+      try {
+        updated = ImageType::open (watch_path);
+      }
+      catch (Exception& e) {
+        // most likely still being written - retried on the next modification:
+        DEBUG ("error re-opening watched image: " + e.description[0]);
+        return false;
+      }
+
+      bool same_size = updated.ndim() == image.ndim();
+      for (size_t n = 0; same_size && n < image.ndim(); ++n)
+        same_size = updated.size(n) == image.size(n);
+
+      view.switch_image (image, updated);
+      view.clear_caches();
+      image = updated;
+
+      if (!same_size) {
+        view.colourmaps[1].invalidate_scaling();
+        checksum_key.clear();
+        return true;
+      }
+      const uint64_t sum = view.checksum (image);
+      if (sum == checksum)
+        return false;
+      checksum = sum;
+      return true;
+    }
+};
+
+
+
+
+
+
+
+// load the overlay image, if requested:
+void load_overlay (View& view)
+{
+  auto opt = get_options ("overlay");
+  if (!opt.size())
+    return;
+  auto overlay = Image<value_type>::open (opt[0][0]);
+  view.set_overlay (overlay, get_option_value ("overlay_threshold", value_type(0.0)),
+      get_option_value ("overlay_colourmap", 1));
+}
+
+
+
+
+// Image-dependent setup of the view: centre the focus, apply any -focus
+// position requested, and convert the zoom factor to the image's voxel size.
+void setup_view (View& view, ImageType& image, const vector<default_type>& position)
+{
+  view.vol_axis = image.ndim() > 3 ? 3 : -1;
+  view.set_axes();
+  for (int a = 0; a < 3; ++a)
+    view.focus[a] = std::round (image.size(a)/2.0);
+
+  if (view.rgb && (image.ndim() < 4 || image.size(3) < 3))
+    throw Exception ("RGB display requires an image with at least 3 volumes");
+
+  if (view.plot_axis >= int(image.ndim()))
+    throw Exception("plot axis larger than image dimension, needs to be in [0..." + str(image.ndim()-1) + "].");
+
+  if (position.size()) {
+    vector<default_type> p = position;
+    if (p.size() > image.ndim())
+      throw Exception ("number of indices passed to -focus option exceeds image dimensions");
+    for (unsigned int n = 0; n < p.size(); ++n) {
+      if (std::isfinite (p[n])) {
+        p[n] = Math::round<default_type>(p[n]);
+        if (p[n] < 0 || p[n] > image.size(n)-1)
+          throw Exception ("position passed to -focus option is out of bounds for axis "+str(n));
+        if (n < 3)
+          view.focus[n] = p[n];
+        else
+          image.index(n) = p[n];
+      }
+    }
+  }
+
+  view.zoom /= std::min (std::min (image.spacing(0), image.spacing(1)), image.spacing(2));
+}
+
+
+
+
+
+
+
+// Memory budget shared by the batch rendering threads: each thread reserves
+// the estimated footprint of its image before opening it, and waits for
+// other threads to release theirs if that would exceed the limit. An image
+// larger than the limit is still processed, but only on its own.
+class MemoryBudget
+{
+  public:
+    MemoryBudget (size_t limit) : limit (limit), in_use (0) { }
+
+    void acquire (size_t bytes) {
+      std::unique_lock<std::mutex> lock (mutex);
+      condition.wait (lock, [&] { return !in_use || in_use + bytes <= limit; });
+      in_use += bytes;
+    }
+
+    void release (size_t bytes) {
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        in_use -= bytes;
+      }
+      condition.notify_all();
+    }
+
+  private:
+    const size_t limit;
+    size_t in_use;
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+
+
+
+// per-stage timings accumulated over all images (summed across threads):
+struct BatchStats
+{
+  std::mutex mutex;
+  double open = 0.0, autoscale = 0.0, render = 0.0;
+  size_t num_rendered = 0, num_failed = 0, bytes = 0;
+};
+
+
+
+
+class BatchRenderer
+{
+  public:
+    BatchRenderer (const vector<std::string>& inputs, const vector<std::string>& outputs,
+        const View& settings, const vector<default_type>& position,
+        std::atomic<size_t>& next, MemoryBudget& budget, BatchStats& stats) :
+      inputs (inputs), outputs (outputs), settings (settings), position (position),
+      next (next), budget (budget), stats (stats) { }
+
+    void execute () {
+      // each image is rendered on this thread alone:
+      ParallelRegion region;
+      size_t n;
+      while ((n = next++) < inputs.size()) {
+        try {
+          render (inputs[n], outputs[n]);
+        }
+        catch (Exception& e) {
+          Exception (e, "failed to render image \"" + inputs[n] + "\"").display();
+          std::lock_guard<std::mutex> lock (stats.mutex);
+          ++stats.num_failed;
+        }
+      }
+    }
+
+  private:
+    const vector<std::string>& inputs;
+    const vector<std::string>& outputs;
+    const View& settings;
+    const vector<default_type>& position;
+    std::atomic<size_t>& next;
+    MemoryBudget& budget;
+    BatchStats& stats;
+
+    void render (const std::string& input, const std::string& output)
+    {
+      Timer timer;
+      auto header = Header::open (input);
+      // as loaded, i.e. converted to floating-point:
+      const size_t footprint = voxel_count (header) * sizeof(value_type);
+      budget.acquire (footprint);
+      try {
+        auto image = header.get_image<value_type>();
+        const double t_open = timer.elapsed();
+
+        View view (settings);
+        setup_view (view, image, position);
+
+        timer.start();
+        if (!view.colourmaps[1].scaling_set())
+          view.autoscale (image, view.colourmaps[1]);
+        const double t_autoscale = timer.elapsed();
+
+        timer.start();
+        File::OFStream out (output);
+        view.display (out, image);
+        out << "\n";
+        const size_t bytes = out.tellp();
+        out.close();
+        if (view.profiler)
+          view.profiler->finish (bytes);
+        const double t_render = timer.elapsed();
+
+        budget.release (footprint);
+
+        std::lock_guard<std::mutex> lock (stats.mutex);
+        stats.open += t_open;
+        stats.autoscale += t_autoscale;
+        stats.render += t_render;
+        stats.bytes += bytes;
+        ++stats.num_rendered;
+      }
+      catch (...) {
+        budget.release (footprint);
+        throw;
+      }
+    }
 };
 
 
 
 
+// render each input image to its own sixel file within 'folder':
+void batch_render (const vector<std::string>& inputs, const std::string& folder,
+    const View& settings, const vector<default_type>& position, size_t memory_limit)
+{
+  if (!Path::exists (folder))
+    File::mkdir (folder);
+  else if (!Path::is_dir (folder))
+    throw Exception ("output path \"" + folder + "\" exists but is not a directory");
+
+  // output file named after input, disambiguated if base names clash, using
+  // a suffix that does not give the name of another output either:
+  vector<std::string> outputs;
+  std::set<std::string> names, used;
+  auto base_name = [] (const std::string& path) {
+    const std::string name = Path::basename (path);
+    return name.substr (0, name.find ('.'));
+  };
+  for (const auto& in : inputs)
+    names.insert (base_name (in));
+  std::map<std::string,size_t> count;
+  for (const auto& in : inputs) {
+    const std::string base = base_name (in);
+    std::string name = base;
+    while (used.count (name) || (name != base && names.count (name)))
+      name = base + "_" + str(++count[base]);
+    used.insert (name);
+    outputs.push_back (Path::join (folder, name + ".six"));
+  }
+
+  MemoryBudget budget (memory_limit);
+  BatchStats stats;
+  std::atomic<size_t> next (0);
+
+  Timer timer;
+  BatchRenderer renderer (inputs, outputs, settings, position, next, budget, stats);
+  // the profiler accumulates the stages of a single frame at a time, so the
+  // images are rendered one after the other when profiling:
+  if (settings.profiler)
+    renderer.execute();
+  else
+    Thread::run (Thread::multi (renderer), "mrpeek batch renderer");
+  const double elapsed = timer.elapsed();
+
+  auto per_image = [&](double t) { return str(1000.0*t/std::max<size_t> (stats.num_rendered, 1), 4) + " ms/image"; };
+  CONSOLE ("rendered " + str(stats.num_rendered) + " images in " + str(elapsed, 4) + " s ("
+      + str(stats.num_rendered/elapsed, 4) + " images/s, " + str(stats.bytes/(1024.0*1024.0), 4) + " MB written)");
+  CONSOLE ("  open:      " + per_image (stats.open));
+  CONSOLE ("  autoscale: " + per_image (stats.autoscale));
+  CONSOLE ("  render:    " + per_image (stats.render));
+
+  if (stats.num_failed)
+    throw Exception ("failed to render " + str(stats.num_failed) + " of " + str(inputs.size()) + " images");
+}
+
+
+
+
+
+
+
+#ifndef MRTRIX_WINDOWS
+
+// Requests sent to the render daemon consist of one "key value" entry per
+// line, holding the image path, the -focus position, and the view settings:
+std::string encode_request (const std::string& path, const View& view, const vector<default_type>& position)
+{
+  std::string request = "image " + path + "\n";
+  if (position.size()) {
+    request += "focus";
+    for (auto p : position)
+      request += " " + str(p);
+    request += "\n";
+  }
+  request += "levels " + str(view.levels) + "\n"
+    + "slice_axis " + str(view.slice_axis) + "\n"
+    + "plot_axis " + str(view.plot_axis) + "\n"
+    + "percentile_range " + str(view.pmin) + " " + str(view.pmax) + "\n"
+    + "zoom " + str(view.zoom) + "\n"
+    + "lightbox " + str(view.lightbox) + "\n"
+    + "volume_grid " + str(view.volume_grid) + "\n"
+    + "projection " + str(int(view.projection)) + "\n"
+    + "temporal " + str(int(view.temporal)) + "\n"
+    + "rgb " + str(int(view.rgb)) + "\n"
+    + "labels " + str(int(view.labels_mode)) + "\n"
+    + "plot_roi " + str(view.plot_roi) + " " + str(int(view.plot_roi_sphere)) + "\n"
+    + "colourmap " + str(view.colourmaps[1].ID) + "\n"
+    + "flags " + str(int(view.crosshair)) + str(int(view.colorbar)) + str(int(view.orthoview))
+      + str(int(view.do_plot)) + str(int(view.show_image)) + str(int(view.interpolate)) + str(int(view.show_text)) + "\n";
+  if (view.colourmaps[1].scaling_set())
+    request += "scaling " + str(view.colourmaps[1].offset(), 10) + " " + str(view.colourmaps[1].scale(), 10) + "\n";
+  return request;
+}
+
+
+
+View decode_request (const std::string& request, std::string& path, vector<default_type>& position)
+{
+  View view;
+  view.interactive = false;
+  view.colourmaps.add (STATIC_CMAP);
+  view.colourmaps.add (0, view.levels);
+  float offset = NaN, scale = NaN;
+
+  std::istringstream in (request);
+  std::string line;
+  while (std::getline (in, line)) {
+    const auto space = line.find (' ');
+    const std::string key = line.substr (0, space);
+    if (space == std::string::npos)
+      throw Exception ("malformed request entry \"" + line + "\"");
+    std::istringstream value (line.substr (space+1));
+    if (key == "image") path = line.substr (space+1);
+    else if (key == "focus") { default_type p; while (value >> p) position.push_back (p); }
+    else if (key == "levels") value >> view.levels;
+    else if (key == "slice_axis") value >> view.slice_axis;
+    else if (key == "plot_axis") value >> view.plot_axis;
+    else if (key == "percentile_range") value >> view.pmin >> view.pmax;
+    else if (key == "zoom") value >> view.zoom;
+    else if (key == "lightbox") value >> view.lightbox;
+    else if (key == "volume_grid") value >> view.volume_grid;
+    else if (key == "projection") { int p; value >> p; view.projection = ProjectionMode (p); }
+    else if (key == "temporal") { int t; value >> t; view.temporal = TemporalStat (t); }
+    else if (key == "rgb") value >> view.rgb;
+    else if (key == "labels") { int l; value >> l; view.labels_mode = LabelsMode (l); }
+    else if (key == "plot_roi") value >> view.plot_roi >> view.plot_roi_sphere;
+    else if (key == "colourmap") value >> view.colourmaps[1].ID;
+    else if (key == "scaling") value >> offset >> scale;
+    else if (key == "flags") {
+      std::string f;
+      value >> f;
+      if (f.size() != 7)
+        throw Exception ("malformed request entry \"" + line + "\"");
+      view.crosshair = f[0] == '1';
+      view.colorbar = f[1] == '1';
+      view.orthoview = f[2] == '1';
+      view.do_plot = f[3] == '1';
+      view.show_image = f[4] == '1';
+      view.interpolate = f[5] == '1';
+      view.show_text = f[6] == '1';
+    }
+    else
+      throw Exception ("unknown request entry \"" + key + "\"");
+  }
+
+  if (path.empty())
+    throw Exception ("no image specified in request");
+
+  // the request comes from another process, so check every value as the
+  // command-line parser would, before it is used to index anything:
+  auto check = [] (bool valid, const char* entry) {
+    if (!valid)
+      throw Exception ("invalid value for \"" + std::string (entry) + "\" in request");
+  };
+  check (view.levels >= 2 && view.levels <= MAX_LEVELS, "levels");
+  check (view.slice_axis >= 0 && view.slice_axis <= 2, "slice_axis");
+  check (view.plot_axis >= 0, "plot_axis");
+  check (view.colourmaps[1].ID >= 0 && view.colourmaps[1].ID < int (colourmap_choices_std.size()), "colourmap");
+  check (view.pmin >= 0.0 && view.pmin <= 100.0 && view.pmax >= 0.0 && view.pmax <= 100.0, "percentile_range");
+  check (view.zoom > 0.0, "zoom");
+  check (view.lightbox >= 0, "lightbox");
+  check (view.volume_grid >= 0, "volume_grid");
+  check (view.plot_roi >= 0, "plot_roi");
+  check (view.projection >= 0 && view.projection < N_PROJECTION_MODES, "projection");
+  check (view.temporal >= 0 && view.temporal < N_TEMPORAL_STATS, "temporal");
+  check (view.labels_mode >= 0 && view.labels_mode < N_LABELS_MODES, "labels");
+  view.colourmaps[1].set_levels (view.levels);
+  if (std::isfinite (offset) && std::isfinite (scale))
+    view.colourmaps[1].set_scaling (offset, scale);
+  return view;
+}
+
+
+
+
+// Images held open by the render daemon, along with the intensity scaling
+// and derived data (projections, temporal statistics) computed for the views
+// requested so far. An image is reopened if any of the files holding it has
+// been modified since. The least recently used images are closed once the
+// memory occupied by the images (as converted to floating-point) and the data
+// derived from them exceeds the limit.
+class ImageCache
+{
+  public:
+    ImageCache (size_t limit) : limit (limit), counter (0) { }
+
+    struct Entry {
+      ImageType image;
+      size_t bytes, cache_bytes, last_used;
+      std::string file_state;
+      std::map<std::string,std::pair<float,float>> scaling;
+      std::shared_ptr<ROIStats> roi_stats;
+      std::shared_ptr<ProjectionCache> projections;
+      std::shared_ptr<TemporalStats> temporal_stats;
+    };
+
+    Entry& get (const std::string& path)
+    {
+      struct stat info;
+      if (stat (path.c_str(), &info))
+        throw Exception ("unable to access image \"" + path + "\"");
+
+      auto it = images.find (path);
+      if (it != images.end() && it->second.file_state != file_state (path, it->second.image)) {
+        INFO ("image \"" + path + "\" modified on disk - reopening");
+        images.erase (it);
+        it = images.end();
+      }
+
+      if (it == images.end()) {
+        auto header = Header::open (path);
+        Entry entry;
+        entry.bytes = voxel_count (header) * sizeof(value_type);
+        entry.cache_bytes = 0;
+        evict (entry.bytes, path);
+        entry.image = header.get_image<value_type>();
+        entry.file_state = file_state (path, entry.image);
+        it = images.insert ({ path, entry }).first;
+      }
+
+      it->second.last_used = ++counter;
+      return it->second;
+    }
+
+    // record the memory now held by the data derived from the image at
+    // 'path', closing other images if the limit is exceeded as a result:
+    void update (const std::string& path, size_t cache_bytes)
+    {
+      auto it = images.find (path);
+      if (it == images.end())
+        return;
+      it->second.cache_bytes = cache_bytes;
+      evict (0, path);
+    }
+
+  private:
+    const size_t limit;
+    size_t counter;
+    std::map<std::string,Entry> images;
+
+    // modification time, size & inode of all files holding the image:
+    static std::string file_state (const std::string& path, const ImageType& image)
+    {
+      std::string state;
+      for (const auto& file : image_files (path, image.header())) {
+        struct stat info;
+        if (!stat (file.c_str(), &info))
+          state += str(info.st_mtime) + " " + str(info.st_size) + " " + str(info.st_ino);
+        state += ";";
+      }
+      return state;
+    }
+
+    // close least recently used images (other than the one at 'keep') until
+    // 'bytes' can be accommodated:
+    void evict (size_t bytes, const std::string& keep)
+    {
+      size_t in_use = 0;
+      for (const auto& entry : images)
+        in_use += entry.second.bytes + entry.second.cache_bytes;
+      while (in_use + bytes > limit) {
+        auto oldest = images.end();
+        for (auto it = images.begin(); it != images.end(); ++it)
+          if (it->first != keep && (oldest == images.end() || it->second.last_used < oldest->second.last_used))
+            oldest = it;
+        if (oldest == images.end())
+          break;
+        INFO ("closing image \"" + oldest->first + "\"");
+        in_use -= oldest->second.bytes + oldest->second.cache_bytes;
+        images.erase (oldest);
+      }
+    }
+};
+
+
+
+
+void serve_request (int fd, ImageCache& cache)
+{
+  std::string path;
+  vector<default_type> position;
+  View view = decode_request (Daemon::read_all (fd), path, position);
+
+  auto& entry = cache.get (path);
+  ImageType image (entry.image);
+  setup_view (view, image, position);
+  view.roi_stats = entry.roi_stats;
+  view.projections = entry.projections;
+  view.temporal_stats = entry.temporal_stats;
+
+  auto& cmap = view.colourmaps[1];
+  if (!cmap.scaling_set()) {
+    std::string key = str(view.slice_axis) + " " + str(view.focus[view.slice_axis])
+      + " " + str(view.pmin) + " " + str(view.pmax) + " " + str(view.zoom) + " " + str(int(view.projection))
+      + " " + str(int(view.temporal));
+    for (size_t n = 3; n < image.ndim(); ++n)
+      key += " " + str(image.index(n));
+    auto scaling = entry.scaling.find (key);
+    if (scaling == entry.scaling.end()) {
+      view.autoscale (image, cmap);
+      entry.scaling[key] = { cmap.offset(), cmap.scale() };
+    }
+    else
+      cmap.set_scaling (scaling->second.first, scaling->second.second);
+  }
+
+  Daemon::OutputBuffer buffer (fd);
+  std::ostream out (&buffer);
+  view.display (out, image);
+  out << "\n";
+  out.flush();
+
+  // keep anything derived from the image during rendering for later requests:
+  entry.roi_stats = view.roi_stats;
+  entry.projections = view.projections;
+  entry.temporal_stats = view.temporal_stats;
+  cache.update (path, view.cache_bytes());
+}
+
+
+
+
+// report the time taken to process each input replayed using -replay:
+void report_replay (VT::ReplayStats stats)
+{
+  auto& latencies = stats.latencies;
+  if (latencies.empty()) {
+    CONSOLE ("no input replayed");
+    return;
+  }
+  std::sort (latencies.begin(), latencies.end());
+  auto ms = [](double t) { return str(1000.0*t, 4) + " ms"; };
+  auto percentile = [&](double p) { return ms (latencies[std::max (std::ceil (p*latencies.size()/100.0) - 1.0, 0.0)]); };
+
+  CONSOLE ("replayed " + str(latencies.size()) + " inputs in " + str(std::accumulate (latencies.begin(), latencies.end(), 0.0), 4)
+      + " s, producing " + str(stats.bytes/(1024.0*1024.0), 4) + " MB of output");
+  CONSOLE ("  latency: median " + percentile (50) + ", 90th percentile " + percentile (90)
+      + ", 99th percentile " + percentile (99) + ", maximum " + ms (latencies.back()));
+}
+
+
+
+
+// run as render server, until no requests have been received for 'timeout' seconds:
+void run_daemon (size_t memory_limit, default_type timeout)
+{
+  Daemon::Server server (Daemon::socket_path());
+  CONSOLE ("listening on \"" + server.path() + "\"");
+  ImageCache cache (memory_limit);
+
+  while (true) {
+    int fd = server.accept (std::round (1000.0 * timeout));
+    if (fd < 0) {
+      CONSOLE ("no requests received in " + str(timeout) + " s - exiting");
+      return;
+    }
+    try {
+      serve_request (fd, cache);
+    }
+    catch (Exception& e) {
+      std::string message = '\0' + join (e.description, "\n");
+      try {
+        Daemon::write_all (fd, message.data(), message.size());
+      }
+      catch (...) { }
+    }
+    close (fd);
+  }
+}
+
+#endif
+
+
+
+
 
 
 
 void run ()
 {
-  auto image = Image<value_type>::open (argument[0]);
+  View view;
+
+  vector<std::string> inputs;
+  for (const auto& arg : argument)
+    inputs.push_back (arg);
+  auto opt = get_options ("input_list");
+  if (opt.size()) {
+    const std::string list_file = opt[0][0];
+    std::ifstream list (list_file);
+    if (!list)
+      throw Exception ("error opening input list \"" + list_file + "\"");
+    std::string line;
+    while (std::getline (list, line)) {
+      line = strip (line);
+      if (line.size() && line[0] != '#')
+        inputs.push_back (line);
+    }
+  }
+  if (inputs.empty() && !get_options ("daemon").size())
+    throw Exception ("no input images specified");
 
   size_t projection_axes[3] = {get_options("sagittal").size(), get_options("coronal").size(), get_options("axial").size()};
   size_t psum = 0;
   for (int i = 0; i < 3; ++i) {
-    if (projection_axes[i]) { ++psum; slice_axis = i; }
+    if (projection_axes[i]) { ++psum; view.slice_axis = i; }
     if (psum > 1) throw Exception("Projection axes options are mutually exclusive.");
   }
-  orthoview = psum == 0;
-  vol_axis = image.ndim() > 3 ? 3 : -1;
-  set_axes();
-  for (int a = 0; a < 3; ++a)
-    focus[a] = std::round (image.size(a)/2.0);
+  view.orthoview = psum == 0;
 
   int colourmap_ID = get_option_value ("colourmap", 0);
 
-  do_plot = get_options ("plot").size();
-  plot_axis = get_option_value ("plot", plot_axis);
-  if (plot_axis >= int(image.ndim()))
-    throw Exception("plot axis larger than image dimension, needs to be in [0..." + str(image.ndim()-1) + "].");
+  view.do_plot = get_options ("plot").size();
+  view.plot_axis = get_option_value ("plot", view.plot_axis);
 
   //CONF option: MRPeekColourmapLevels
   //CONF default: 32
   //CONF set the default number of colourmap levels to use within mrpeek
-  levels = get_option_value ("levels", File::Config::get_int ("MRPeekColourmapLevels", levels));
+  view.levels = get_option_value ("levels", File::Config::get_int ("MRPeekColourmapLevels", view.levels));
+  if (view.levels < 2 || view.levels > MAX_LEVELS)
+    throw Exception ("number of colourmap levels must be between 2 and " + str(MAX_LEVELS));
 
-  colourmaps.add (STATIC_CMAP);
-  colourmaps.add (colourmap_ID, levels);
+  view.colourmaps.add (STATIC_CMAP);
+  view.colourmaps.add (colourmap_ID, view.levels);
 
-  auto opt = get_options ("intensity_range");
+  opt = get_options ("intensity_range");
   if (opt.size()) {
-    colourmaps[1].set_scaling_min_max (opt[0][0], opt[0][1]);
+    view.colourmaps[1].set_scaling_min_max (opt[0][0], opt[0][1]);
   }
 
   opt = get_options ("percentile_range");
   if (opt.size()) {
-    pmin = opt[0][0];
-    pmax = opt[0][1];
+    view.pmin = opt[0][0];
+    view.pmax = opt[0][1];
   }
 
+  vector<default_type> position;
   opt = get_options ("focus");
-  if (opt.size()) {
-    vector<default_type> p = opt[0][0];
-    if (p.size() > image.ndim())
-      throw Exception ("number of indices passed to -focus option exceeds image dimensions");
-    for (unsigned int n = 0; n < p.size(); ++n) {
-      if (std::isfinite (p[n])) {
-        p[n] = Math::round<default_type>(p[n]);
-        if (p[n] < 0 || p[n] > image.size(n)-1)
-          throw Exception ("position passed to -focus option is out of bounds for axis "+str(n));
-        if (n < 3)
-          focus[n] = p[n];
-        else
-          image.index(n) = p[n];
-      }
-    }
-  }
+  if (opt.size())
+    position = opt[0][0];
 
   if (get_options ("nocrosshairs").size())
-    crosshair = false;
+    view.crosshair = false;
 
   //CONF option: MRPeekScaleImage
-  zoom = get_option_value ("zoom", MR::File::Config::get_float ("MRPeekZoom", zoom));
-  if (zoom <= 0)
+  view.zoom = get_option_value ("zoom", MR::File::Config::get_float ("MRPeekZoom", view.zoom));
+
+  //CONF option: MRPeekCineFPS
+  //CONF default: 10
+  //CONF the frame rate for cine playback within mrpeek.
+  view.frame_rate = get_option_value ("fps", File::Config::get_float ("MRPeekCineFPS", view.frame_rate));
+  if (view.zoom <= 0)
     throw Exception ("zoom value needs to be positive");
-  INFO("zoom: " + str(zoom));
-  zoom /= std::min (std::min (image.spacing(0), image.spacing(1)), image.spacing(2));
+  INFO("zoom: " + str(view.zoom));
+
+  opt = get_options ("plot_roi");
+  if (opt.size()) {
+    view.plot_roi = opt[0][0];
+    view.plot_roi_sphere = int(opt[0][1]) == 1;
+  }
+
+  view.lightbox = get_option_value ("lightbox", 0);
+  view.volume_grid = get_option_value ("volume_grid", 0);
+  if (view.lightbox && view.volume_grid)
+    throw Exception ("-lightbox and -volume_grid options are mutually exclusive");
+
+  view.projection = ProjectionMode (get_option_value ("projection", int(PROJECTION_NONE)));
+  view.temporal = TemporalStat (get_option_value ("temporal", int(TEMPORAL_NONE)));
+  view.rgb = get_options ("rgb").size();
+  view.labels_mode = LabelsMode (get_option_value ("labels", int(LABELS_NONE)));
+
+  view.colorbar = view.show_text = !get_options ("notext").size();
+  view.show_image = !get_options ("noimage").size();
+
+  opt = get_options ("profile");
+  if (opt.size())
+    view.profiler = std::make_shared<Profile::Profiler> (opt[0][0]);
+
+  //CONF option: MRPeekMemoryLimit
+  //CONF default: 2048
+  //CONF the maximum amount of memory (in MB) that images being rendered
+  //CONF concurrently by mrpeek -output_dir, or held open by the mrpeek
+  //CONF render daemon, are allowed to occupy.
+  const size_t memory_limit = 1024 * 1024 * size_t (get_option_value ("memory_limit",
+        File::Config::get_int ("MRPeekMemoryLimit", 2048)));
+
+#ifndef MRTRIX_WINDOWS
+  if (get_options ("daemon").size()) {
+    run_daemon (memory_limit, get_option_value ("daemon_timeout", 600.0));
+    return;
+  }
+#endif
 
-  colorbar = show_text = !get_options ("notext").size();
-  show_image = !get_options ("noimage").size();
+  opt = get_options ("output_dir");
+  if (opt.size()) {
+    if (get_options ("overlay").size())
+      throw Exception ("-overlay option cannot be used with -output_dir");
+    view.interactive = false;
+    batch_render (inputs, opt[0][0], view, position, memory_limit);
+    return;
+  }
 
 #ifdef MRTRIX_WINDOWS
-  interactive = false;
-  std::cout << display (image, colourmaps) << "\n";
+  if (inputs.size() > 1)
+    throw Exception ("multiple input images can only be rendered using the -output_dir option");
+
+  auto image = Image<value_type>::open (inputs[0]);
+  setup_view (view, image, position);
+  load_overlay (view);
+  view.interactive = false;
+  show_frame (view, image);
+  std::cout << "\n";
 #else
-  interactive = isatty (STDOUT_FILENO);
+  view.interactive = isatty (STDOUT_FILENO);
   if (get_options ("batch").size())
-    interactive = false;
+    view.interactive = false;
+  const bool watch = get_options ("watch").size();
+
+  // a replayed session is interactive, even if not run from a terminal:
+  auto record = get_options ("record");
+  auto replay = get_options ("replay");
+  if (replay.size()) {
+    if (record.size() || watch || get_options ("batch").size())
+      throw Exception ("-replay option cannot be combined with the -record, -watch or -batch options");
+    view.interactive = true;
+    view.background = false;
+  }
+
+  if (inputs.size() > 1 && !view.interactive)
+    throw Exception ("multiple input images can only be rendered interactively, or using the -output_dir option");
+  if (watch && (!view.interactive || inputs.size() > 1))
+    throw Exception ("-watch option can only be used interactively with a single input image");
+  if (record.size() && !view.interactive)
+    throw Exception ("-record option can only be used interactively");
+
+  // hand over to the render daemon if one is running. Overlays and profiling
+  // are handled locally, as are images that the daemon cannot open by path
+  // (e.g. '-' for an image piped through stdin):
+  struct stat input_stat;
+  const bool regular_file = !stat (inputs[0].c_str(), &input_stat) && S_ISREG (input_stat.st_mode);
+  if (!view.interactive && regular_file && !view.profiler
+      && !get_options ("nodaemon").size() && !get_options ("overlay").size()) {
+    int fd = -1;
+    try {
+      fd = Daemon::connect (Daemon::socket_path());
+    }
+    catch (Exception& e) {
+      e.display (1);
+    }
+    if (fd >= 0) {
+      std::string path = inputs[0];
+      if (path[0] != '/') {
+        char cwd[4096];
+        if (getcwd (cwd, sizeof(cwd)))
+          path = std::string (cwd) + "/" + path;
+      }
+      try {
+        Daemon::send_request (fd, encode_request (path, view, position), std::cout);
+      }
+      catch (...) {
+        close (fd);
+        throw;
+      }
+      close (fd);
+      return;
+    }
+  }
 
-  if (!interactive) {
-    std::cout << display (image, colourmaps) << "\n";
+  auto image = Image<value_type>::open (inputs[0]);
+  setup_view (view, image, position);
+  load_overlay (view);
+
+  if (!view.interactive) {
+    show_frame (view, image);
+    std::cout << "\n";
     return;
   }
 
   try {
+    // the terminal's responses to the queries below are part of the input
+    // recorded or replayed:
+    if (replay.size())
+      VT::replay_input (replay[0][0]);
+    else if (record.size())
+      VT::record_input (record[0][0]);
+
     // start loop
     enter_raw_mode();
     Sixel::init();
+
+    // limit rendering to the visible window, leaving room for the text lines:
+    int width, height, line_height;
+    Sixel::query_window_size (width, height, line_height);
+    if (width > 0 && height > 4*line_height) {
+      view.max_width = width;
+      view.max_height = height - 4*line_height;
+      INFO ("terminal window size: " + str(width) + " x " + str(height) + " pixels");
+    }
     std::cout << ClearScreen;
 
-    CallBack callback (image);
+    if (image.ndim() > 3 && view.background)
+      view.cache_timeseries();
+
+    // flip between multiple images, keeping any intensity range requested:
+    std::unique_ptr<ImageSession> session;
+    if (inputs.size() > 1) {
+      session.reset (new ImageSession (inputs, get_options ("intensity_range").size(), view.background));
+      view.caption = session->caption (0);
+    }
+
+    CallBack callback (view, image, session.get());
+
+    //CONF option: MRPeekWatchDebounce
+    //CONF default: 200
+    //CONF the time (in ms) for which mrpeek -watch waits for modifications
+    //CONF of the image to cease before updating the display.
+    std::unique_ptr<FileWatcher> watcher;
+    if (watch) {
+      // watch the data file(s) as well as the header, e.g. for .mih images:
+      watcher.reset (new FileWatcher (image_files (inputs[0], image.header()),
+            File::Config::get_int ("MRPeekWatchDebounce", 200), VT::wake_event_loop));
+      callback.watch (watcher.get(), inputs[0]);
+    }
+
     EventLoop event_loop (callback);
     event_loop.run();
     exit_raw_mode();
+    if (VT::replaying())
+      report_replay (VT::end_replay());
   }
   catch (...) {
     exit_raw_mode();
+    if (VT::replaying())
+      VT::end_replay();
     throw;
   }
 #endif
@@ -0,0 +1,678 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <random>
+
+#include "command.h"
+#include "header.h"
+#include "image.h"
+#include "thread.h"
+#include "timer.h"
+#include "algo/loop.h"
+#include "file/ofstream.h"
+#include "file/path.h"
+
+#include "file_watcher.h"
+#include "profile.h"
+#include "sixel.h"
+#include "view.h"
+
+using namespace MR;
+using namespace App;
+using namespace MR::Render;
+
+#ifdef MRTRIX_WINDOWS
+# define NULL_DEVICE "NUL"
+#else
+# define NULL_DEVICE "/dev/null"
+# include <unistd.h>
+#endif
+
+#define BENCHMARK_ZOOM 2.0
+
+
+void usage ()
+{
+  AUTHOR = "Jianxiao Wu (vesaveronica@gmail.com) & "
+    "Max Pietsch (maximilian.pietsch@kcl.ac.uk) & "
+    "Daan Christiaens (daan.christiaens@kcl.ac.uk) & "
+    "J-Donald Tournier (jdtournier@gmail.com)";
+
+  SYNOPSIS = "measure the rendering performance of mrpeek, without requiring a terminal";
+
+  DESCRIPTION
+    + "Synthetic images of several sizes and datatypes are generated, and the main stages "
+    "of the rendering pipeline are timed separately: sixel encoding of canvases of "
+    "different sizes and numbers of colourmap levels, resampling of a slice using "
+    "nearest-neighbour and linear interpolation, automatic intensity scaling, intensity "
+    "plots, and full orthoview frames. All output is written to " NULL_DEVICE "."
+
+    + "Each benchmark is run once as a warm-up, then repeatedly until the minimum time "
+    "requested has elapsed. The time per frame, frames per second, throughput and size "
+    "of the output per frame are reported for each. Throughput refers to the canvas "
+    "pixels (one byte each) for encoding and resampling, to the image intensities "
+    "processed for automatic scaling, and to the sixel data output for plots and full "
+    "frames."
+
+    + "With the -check option, the output of the sixel encoder is verified instead, "
+    "for a fixed set of canvases (gradients, noise, slices of a synthetic image, with "
+    "different numbers of levels and colourmaps). The output for each canvas is decoded "
+    "back and compared with the original canvas, and with the output previously "
+    "stored in a folder of golden files: by default, the testing/golden folder "
+    "distributed with mrpeek (see -golden and -update_golden). The size of the "
+    "output per pixel is reported for each canvas, so that changes in the compression "
+    "achieved show up along with any errors. The detection of modifications to an "
+    "image stored as separate header and data files (as used by mrpeek -watch) is "
+    "also verified, by rewriting only its data file, as is the replay of a session "
+    "flipping between two such images without a terminal (using the mrpeek executable "
+    "in the same folder). The command fails if any check does.";
+
+  OPTIONS
+  + Option ("time",
+            "the minimum time (in seconds) for which each benchmark is run. Default is 0.5.")
+    + Argument ("seconds").type_float (0.0)
+
+  + Option ("quick",
+            "only run the benchmarks for the smallest image and canvas size")
+
+  + Option ("check",
+            "verify the output of the sixel encoder, the detection of modifications to "
+            "image files, and the replay of a session without a terminal, rather than "
+            "measuring performance.")
+
+  + Option ("golden",
+            "with -check, compare the output for each canvas with the golden file of the "
+            "same name in the specified folder, rather than in the testing/golden folder "
+            "distributed with mrpeek.")
+    + Argument ("folder").type_directory_in()
+
+  + Option ("update_golden",
+            "with -check, store the output for each canvas as its golden file, replacing "
+            "any that differ or are missing (e.g. once a change to the output of the "
+            "encoder has been verified). Otherwise, a missing golden file is an error.")
+
+  + Option ("json",
+            "write the results to the specified file in JSON format, e.g. to track "
+            "performance across versions.")
+    + Argument ("file").type_file_out();
+}
+
+
+
+
+
+// output discarded to the null device, counting the number of bytes written:
+class NullOutput : public std::streambuf
+{
+  public:
+    NullOutput () : count (0) {
+      if (!file.open (NULL_DEVICE, std::ios::out | std::ios::binary))
+        throw Exception ("error opening \"" NULL_DEVICE "\" for output");
+    }
+    size_t count;
+
+  protected:
+    int overflow (int c) override {
+      if (c != EOF) {
+        ++count;
+        file.sputc (c);
+      }
+      return c;
+    }
+    std::streamsize xsputn (const char* s, std::streamsize n) override {
+      count += n;
+      return file.sputn (s, n);
+    }
+
+  private:
+    std::filebuf file;
+};
+
+
+
+struct Result
+{
+  std::string benchmark, setting;
+  size_t iterations;
+  double seconds;  // total time over all iterations
+  size_t bytes;  // total output over all iterations
+  size_t data;  // data processed per frame for the throughput, if not the output
+
+  double ms_per_frame () const { return 1000.0 * seconds / iterations; }
+  double frames_per_s () const { return iterations / seconds; }
+  double MB_per_s () const { return 1.0e-6 * (data ? data * iterations : bytes) / seconds; }
+  size_t bytes_per_frame () const { return bytes / iterations; }
+};
+
+
+
+// run 'frame' once as a warm-up, then repeatedly for at least 'min_time'
+// seconds (and at least 3 times). Each invocation returns the time taken by
+// the stage being measured, which may be only part of the work it does:
+template <class Functor>
+void measure (Result& result, double min_time, Functor&& frame)
+{
+  frame();
+  result.iterations = 0;
+  result.seconds = 0.0;
+  result.bytes = 0;
+  Timer timer;
+  do {
+    result.seconds += frame();
+    ++result.iterations;
+  } while (timer.elapsed() < min_time || result.iterations < 3);
+}
+
+
+
+
+
+// a smooth blob on a uniform background, as for a typical slice:
+inline float pattern (float x, float y, float z = 0.5f)
+{
+  const float dx = x-0.5f, dy = y-0.5f, dz = z-0.5f;
+  if (dx*dx + dy*dy + dz*dz > 0.16f)
+    return 0.0f;
+  return 0.5f + 0.5f * std::sin (20.0f*dx) * std::cos (15.0f*dy);
+}
+
+
+
+Result encode (std::ostream& out, NullOutput& output, int size, int levels, double min_time)
+{
+  Sixel::ColourMaps colourmaps;
+  colourmaps.add (STATIC_CMAP);
+  colourmaps.add (0, levels);
+  colourmaps[1].set_scaling_min_max (0.0f, 1.0f);
+
+  Sixel::Encoder encoder (size, size, colourmaps);
+  auto canvas = encoder.viewport();
+  for (int y = 0; y < size; ++y)
+    for (int x = 0; x < size; ++x)
+      canvas (x,y) = colourmaps[1] (pattern (float(x)/size, float(y)/size));
+
+  Result result { "encode", str(size) + "x" + str(size) + ", " + str(levels) + " levels", 0, 0.0, 0, size_t(size)*size };
+  measure (result, min_time, [&] () {
+      const size_t start = output.count;
+      Timer timer;
+      encoder.write (out);
+      out.flush();
+      result.bytes += output.count - start;
+      return timer.elapsed();
+  });
+  return result;
+}
+
+
+
+ImageType synthetic_image (const vector<int>& size, DataType datatype)
+{
+  Header header;
+  header.ndim (3);
+  for (size_t n = 0; n < 3; ++n) {
+    header.size(n) = size[n];
+    header.spacing(n) = 1.0;
+  }
+  header.datatype() = datatype;
+  header.datatype().set_byte_order_native();
+
+  auto image = ImageType::scratch (header, "synthetic image");
+  // intensities within the range of the smallest datatype used:
+  for (auto l = Loop (0, 3) (image); l; ++l)
+    image.value() = std::round (250.0f * pattern (float(image.index(0))/size[0],
+          float(image.index(1))/size[1], float(image.index(2))/size[2]));
+  return image;
+}
+
+
+
+View default_view (ImageType& image)
+{
+  View view;
+  view.colourmaps.add (STATIC_CMAP);
+  view.colourmaps.add (0, view.levels);
+  view.interactive = false;
+  view.zoom = BENCHMARK_ZOOM;
+  view.vol_axis = -1;
+  view.set_axes();
+  for (int n = 0; n < 3; ++n)
+    view.focus[n] = image.size(n) / 2;
+  return view;
+}
+
+
+
+// benchmarks rendering the image, stepping through its slices at each frame:
+vector<Result> render (std::ostream& out, NullOutput& output, ImageType& image, const std::string& description, double min_time)
+{
+  vector<Result> results;
+  const size_t pixels = std::round (image.size(0) * BENCHMARK_ZOOM) * std::round (image.size(1) * BENCHMARK_ZOOM);
+  int slice = 0;
+  auto next_slice = [&] (View& view) {
+    view.focus[view.slice_axis] = slice++ % image.size (view.slice_axis);
+  };
+
+  // resampling of a single slice, as timed by the profiler:
+  for (bool interpolate : { false, true }) {
+    View view = default_view (image);
+    view.orthoview = false;
+    view.interpolate = interpolate;
+    view.profiler = std::make_shared<Profile::Profiler>();
+    Result result { "resample", description + ", " + (interpolate ? "linear" : "nearest"), 0, 0.0, 0, pixels };
+    measure (result, min_time, [&] () {
+        next_slice (view);
+        const size_t start = output.count;
+        view.display (out, image);
+        out.flush();
+        view.profiler->finish (output.count - start);
+        result.bytes += view.profiler->bytes();
+        return view.profiler->time (Profile::REGRID) + view.profiler->time (Profile::RENDER);
+    });
+    results.push_back (result);
+  }
+
+  {
+    View view = default_view (image);
+    Result result { "autoscale", description, 0, 0.0, 0, pixels * sizeof(value_type) };
+    measure (result, min_time, [&] () {
+        next_slice (view);
+        Timer timer;
+        view.autoscale (image, view.colourmaps[1]);
+        return timer.elapsed();
+    });
+    results.push_back (result);
+  }
+
+  // the remaining benchmarks time the output of complete frames:
+  auto frames = [&] (View& view, Result& result) {
+    measure (result, min_time, [&] () {
+        next_slice (view);
+        const size_t start = output.count;
+        Timer timer;
+        view.display (out, image);
+        out.flush();
+        const double elapsed = timer.elapsed();
+        result.bytes += output.count - start;
+        return elapsed;
+    });
+    results.push_back (result);
+  };
+
+  {
+    View view = default_view (image);
+    view.show_image = false;
+    view.do_plot = true;
+    view.plot_axis = 0;
+    Result result { "plot", description, 0, 0.0, 0, 0 };
+    frames (view, result);
+  }
+
+  {
+    View view = default_view (image);
+    Result result { "orthoview", description, 0, 0.0, 0, 0 };
+    frames (view, result);
+  }
+
+  return results;
+}
+
+
+
+
+
+// canvases to verify the sixel encoder on:
+struct Canvas
+{
+  std::string name;
+  int x_dim, y_dim;
+  Sixel::ColourMaps colourmaps;
+  vector<uint8_t> data;
+};
+
+
+
+vector<Canvas> encoder_corpus ()
+{
+  vector<Canvas> corpus;
+  auto add = [&] (const std::string& name, int x_dim, int y_dim, const vector<int>& levels) -> Canvas& {
+    corpus.push_back ({ name, x_dim, y_dim, Sixel::ColourMaps(), vector<uint8_t> (size_t(x_dim)*y_dim, 0) });
+    auto& canvas = corpus.back();
+    canvas.colourmaps.add (STATIC_CMAP);
+    for (size_t n = 0; n < levels.size(); ++n) {
+      canvas.colourmaps.add (n, levels[n]);
+      canvas.colourmaps[n+1].set_scaling_min_max (0.0f, 1.0f);
+    }
+    return canvas;
+  };
+
+  // a slice of the synthetic image, with crosshairs and a highlighted frame,
+  // and any values above 'threshold' shown using the overlay colourmap:
+  auto slice = [] (Canvas& canvas, float threshold = 2.0f) {
+    for (int y = 0; y < canvas.y_dim; ++y) {
+      for (int x = 0; x < canvas.x_dim; ++x) {
+        const float value = pattern (float(x)/canvas.x_dim, float(y)/canvas.y_dim);
+        uint8_t colour = value > threshold ? canvas.colourmaps[2] (value) : canvas.colourmaps[1] (value);
+        if (x == canvas.x_dim/3 || y == canvas.y_dim/2)
+          colour = CROSSHAIR_COLOUR;
+        if (x == 0 || y == 0 || x == canvas.x_dim-1 || y == canvas.y_dim-1)
+          colour = HIGHLIGHT_COLOUR;
+        canvas.data[x + size_t(y)*canvas.x_dim] = colour;
+      }
+    }
+  };
+
+  std::minstd_rand random (1);
+  for (int levels : { 8, 32, 128 }) {
+    auto& gradient = add ("gradient_" + str(levels), 256, 128, { levels });
+    for (int y = 0; y < gradient.y_dim; ++y)
+      for (int x = 0; x < gradient.x_dim; ++x)
+        gradient.data[x + size_t(y)*gradient.x_dim] = gradient.colourmaps[1] (float(x) / (gradient.x_dim-1));
+
+    auto& noise = add ("noise_" + str(levels), 256, 128, { levels });
+    for (auto& colour : noise.data)
+      colour = noise.colourmaps[1].index + random() % (levels+1);
+
+    slice (add ("slice_" + str(levels), 256, 256, { levels }));
+  }
+
+  slice (add ("slice_overlay", 256, 256, { 32, 32 }), 0.8f);
+  slice (add ("slice_odd_size", 97, 61, { 32 }));
+  add ("blank", 128, 64, { 32 });
+  slice (add ("single_row", 300, 1, { 32 }));
+
+  return corpus;
+}
+
+
+
+void check_encoder (const std::string& golden, bool update_golden, const std::string& json)
+{
+  size_t failed = 0;
+  std::ostringstream results;
+  const auto corpus = encoder_corpus();
+  for (const auto& canvas : corpus) {
+    Sixel::Encoder encoder (canvas.x_dim, canvas.y_dim, canvas.colourmaps);
+    auto view = encoder.viewport();
+    for (int y = 0; y < canvas.y_dim; ++y)
+      for (int x = 0; x < canvas.x_dim; ++x)
+        view (x,y) = canvas.data[x + size_t(y)*canvas.x_dim];
+    const std::string output = encoder.write();
+
+    // the colour registers used need not match the colour indices, so
+    // compare the colours displayed:
+    vector<uint8_t> decoded;
+    vector<std::array<int,3>> palette;
+    bool round_trip = false;
+    try {
+      Sixel::decode (output, canvas.x_dim, canvas.y_dim, decoded, palette);
+      round_trip = true;
+      std::array<int,3> expected;
+      for (size_t n = 0; n < decoded.size() && round_trip; ++n)
+        round_trip = canvas.colourmaps.colour (canvas.data[n], expected) && palette[decoded[n]] == expected;
+    }
+    catch (Exception& e) {
+      e.display (2);
+    }
+
+    std::string status = "missing";
+    const std::string path = Path::join (golden, canvas.name + ".six");
+    if (Path::exists (path)) {
+      std::ifstream in (path, std::ios::in | std::ios::binary);
+      const std::string expected ((std::istreambuf_iterator<char> (in)), std::istreambuf_iterator<char>());
+      status = expected == output ? "match" : "MISMATCH";
+    }
+    if (update_golden && status != "match") {
+      File::OFStream out (path);
+      out << output;
+      status = "updated";
+    }
+    if (!round_trip || status == "MISMATCH" || status == "missing")
+      ++failed;
+
+    const double bytes_per_pixel = double (output.size()) / (size_t(canvas.x_dim) * canvas.y_dim);
+    std::cout << std::fixed << std::left << std::setw (18) << canvas.name << std::right
+      << std::setw (5) << canvas.x_dim << "x" << std::left << std::setw (5) << canvas.y_dim << std::right
+      << std::setw (10) << output.size() << " bytes" << std::setprecision (4) << std::setw (10) << bytes_per_pixel << " bytes/pixel"
+      << "   round-trip: " << (round_trip ? "ok    " : "FAILED") << "   golden: " << status << "\n";
+
+    results << (results.tellp() ? ",\n" : "\n") << std::setprecision (6)
+      << "    { \"canvas\": \"" << canvas.name << "\", \"x_dim\": " << canvas.x_dim << ", \"y_dim\": " << canvas.y_dim
+      << ", \"bytes\": " << output.size() << ", \"bytes_per_pixel\": " << bytes_per_pixel
+      << ", \"round_trip\": " << (round_trip ? "true" : "false") << ", \"golden\": \"" << status << "\" }";
+  }
+
+  if (json.size()) {
+    File::OFStream out (json);
+    out << "{\n  \"checks\": [" << results.str() << "\n  ]\n}\n";
+  }
+
+  if (failed)
+    throw Exception ("sixel encoder check failed for " + str(failed) + " of " + str(corpus.size()) + " canvases");
+}
+
+
+
+
+
+#ifndef MRTRIX_WINDOWS
+
+// temporary folder holding the images created for the checks below,
+// removed along with them once done:
+class TempFolder
+{
+  public:
+    TempFolder () {
+      char name[] = "/tmp/mrpeek_bench-XXXXXX";
+      if (!mkdtemp (name))
+        throw Exception ("error creating temporary folder: " + std::string (strerror (errno)));
+      path = name;
+    }
+    ~TempFolder () {
+      for (const auto& file : files)
+        std::remove (file.c_str());
+      rmdir (path.c_str());
+    }
+
+    // create a small image stored as separate header and data files,
+    // returning the path to its header:
+    std::string image (const std::string& name) {
+      const std::string image_path = Path::join (path, name + ".mih");
+      Header header;
+      header.ndim (3);
+      for (size_t n = 0; n < 3; ++n) {
+        header.size(n) = 8;
+        header.spacing(n) = 1.0;
+      }
+      header.datatype() = DataType::Float32;
+      header.datatype().set_byte_order_native();
+      Image<float>::create (image_path, header);
+      files.push_back (image_path);
+      for (const auto& file : image_files (image_path, Header::open (image_path)))
+        if (file != image_path)
+          files.push_back (file);
+      return image_path;
+    }
+
+    // write a file holding 'contents':
+    std::string file (const std::string& name, const std::string& contents) {
+      const std::string file_path = Path::join (path, name);
+      File::OFStream out (file_path);
+      out << contents;
+      files.push_back (file_path);
+      return file_path;
+    }
+
+  private:
+    std::string path;
+    vector<std::string> files;
+};
+
+
+
+// check that rewriting only the data file of a .mih image is detected, as
+// it would be while watching that image:
+bool check_watcher (TempFolder& folder)
+{
+  bool detected = false;
+  vector<std::string> files;
+  try {
+    const std::string path = folder.image ("watched");
+    files = image_files (path, Header::open (path));
+    if (files.size() > 1) {
+      FileWatcher watcher (files, 50, [](){});
+      std::fstream data (files[1], std::ios::in | std::ios::out | std::ios::binary);
+      const float value = 1.0f;
+      data.write (reinterpret_cast<const char*> (&value), sizeof(value));
+      data.close();
+      Timer timer;
+      while (!(detected = watcher.changes()) && timer.elapsed() < 2.0)
+        std::this_thread::sleep_for (std::chrono::milliseconds (10));
+    }
+  }
+  catch (Exception& e) {
+    e.display (2);
+  }
+
+  std::cout << "file watcher: " << files.size() << " file(s) watched, rewrite of data file "
+    << (detected ? "detected" : "NOT DETECTED") << "\n";
+  return detected;
+}
+
+
+
+// check that a session flipping between several images can be replayed
+// without a terminal (e.g. in a headless test run), using the mrpeek
+// executable installed alongside this one:
+bool check_replay (TempFolder& folder)
+{
+  // responses of a 1000x600 pixel terminal with sixel support to the
+  // startup queries, then 'n' for the next image and 'q' to quit (times
+  // in microseconds):
+  const std::string recording = folder.file ("session.txt",
+      "mrpeek input recording\n"
+      "300 1b5b3f36323b3463\n"
+      "400 1b5b31303b3152\n"
+      "500 1b5b3f36323b3463\n"
+      "4000 1b5b343b3630303b31303030741b5b363b31363b38741b5b383b33373b31323574\n"
+      "500000 6e\n"
+      "600000 71\n");
+  const std::string first = folder.image ("first");
+  const std::string second = folder.image ("second");
+
+  const std::string folder_of_executable = Path::dirname (App::argv[0]);
+  const std::string mrpeek = folder_of_executable.empty() ? "mrpeek" : Path::join (folder_of_executable, "mrpeek");
+  const std::string command = "\"" + mrpeek + "\" -quiet -replay \"" + recording + "\" \""
+    + first + "\" \"" + second + "\" < /dev/null > /dev/null";
+  const int status = std::system (command.c_str());
+
+  std::cout << "replay: multi-image session without a terminal "
+    << (status == 0 ? "ok" : "FAILED (exit status " + str(status) + ")") << "\n";
+  return status == 0;
+}
+
+#endif
+
+
+
+
+
+void report (const Result& result)
+{
+  std::cout << std::fixed
+    << std::left << std::setw (11) << result.benchmark << std::setw (32) << result.setting << std::right
+    << std::setprecision (3) << std::setw (10) << result.ms_per_frame() << " ms"
+    << std::setprecision (1) << std::setw (10) << result.frames_per_s() << " fps"
+    << std::setw (10) << result.MB_per_s() << " MB/s"
+    << std::setw (10) << result.bytes_per_frame() << " bytes/frame\n";
+  std::cout.flush();
+}
+
+
+
+void write_json (const std::string& path, const vector<Result>& results, double min_time)
+{
+  File::OFStream out (path);
+  out << std::setprecision (6)
+    << "{\n  \"threads\": " << Thread::number_of_threads() << ",\n  \"min_time\": " << min_time << ",\n  \"results\": [";
+  for (size_t n = 0; n < results.size(); ++n) {
+    const auto& r = results[n];
+    out << (n ? ",\n" : "\n")
+      << "    { \"benchmark\": \"" << r.benchmark << "\", \"setting\": \"" << r.setting << "\""
+      << ", \"iterations\": " << r.iterations
+      << ", \"ms_per_frame\": " << r.ms_per_frame()
+      << ", \"frames_per_s\": " << r.frames_per_s()
+      << ", \"MB_per_s\": " << r.MB_per_s()
+      << ", \"bytes_per_frame\": " << r.bytes_per_frame() << " }";
+  }
+  out << "\n  ]\n}\n";
+}
+
+
+
+
+
+void run ()
+{
+  auto opt = get_options ("json");
+  const std::string json = opt.size() ? std::string (opt[0][0]) : std::string();
+
+  if (get_options ("check").size()) {
+    bool files_ok = true;
+#ifndef MRTRIX_WINDOWS
+    {
+      TempFolder folder;
+      files_ok = check_watcher (folder);
+      files_ok = check_replay (folder) && files_ok;
+    }
+#endif
+    // the golden files are found relative to the executable, in bin/:
+    opt = get_options ("golden");
+    std::string golden = opt.size() ? std::string (opt[0][0]) : std::string();
+    if (golden.empty()) {
+      const std::string bin = Path::dirname (App::argv[0]);
+      golden = Path::join (bin.empty() ? ".." : Path::join (bin, ".."), Path::join ("testing", "golden"));
+    }
+    check_encoder (golden, get_options ("update_golden").size(), json);
+    if (!files_ok)
+      throw Exception ("file watcher or replay check failed");
+    return;
+  }
+
+  const double min_time = get_option_value ("time", 0.5);
+  const bool quick = get_options ("quick").size();
+
+  NullOutput output;
+  std::ostream out (&output);
+  vector<Result> results;
+  auto add = [&] (const Result& result) {
+    report (result);
+    results.push_back (result);
+  };
+
+  for (int size : { 256, 512, 1024 }) {
+    for (int levels : { 8, 32, 128 })
+      add (encode (out, output, size, levels, min_time));
+    if (quick)
+      break;
+  }
+
+  const vector<vector<int>> sizes = { { 64, 64, 48 }, { 128, 128, 96 }, { 256, 256, 192 } };
+  const vector<std::pair<DataType,std::string>> datatypes = {
+    { DataType::UInt8, "uint8" }, { DataType::Int16, "int16" }, { DataType::Float32, "float32" } };
+  for (const auto& size : sizes) {
+    for (const auto& datatype : datatypes) {
+      auto image = synthetic_image (size, datatype.first);
+      const std::string description = str(size[0]) + "x" + str(size[1]) + "x" + str(size[2]) + " " + datatype.second;
+      for (const auto& result : render (out, output, image, description, min_time))
+        add (result);
+    }
+    if (quick)
+      break;
+  }
+
+  if (json.size())
+    write_json (json, results, min_time);
+}
+
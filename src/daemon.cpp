@@ -0,0 +1,252 @@
+#include <cstdlib>
+#include <cstring>
+
+#ifndef MRTRIX_WINDOWS
+# include <unistd.h>
+# include <poll.h>
+# include <signal.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+#endif
+
+#include "exception.h"
+#include "file/config.h"
+#include "daemon.h"
+
+
+namespace MR {
+  namespace Daemon {
+
+#ifndef MRTRIX_WINDOWS
+
+    namespace {
+
+      sockaddr_un socket_address (const std::string& path)
+      {
+        sockaddr_un addr;
+        memset (&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+          throw Exception ("socket path \"" + path + "\" is too long");
+        strncpy (addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+        return addr;
+      }
+
+      // whether the process at the other end of the socket belongs to the
+      // current user - no-one else should see the images requested, or
+      // supply the output rendered:
+      bool peer_is_current_user (int fd)
+      {
+#ifdef SO_PEERCRED
+        struct ucred credentials;
+        socklen_t size = sizeof(credentials);
+        if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size))
+          return false;
+        return credentials.uid == getuid();
+#else
+        uid_t uid;
+        gid_t gid;
+        if (getpeereid (fd, &uid, &gid))
+          return false;
+        return uid == getuid();
+#endif
+      }
+
+    }
+
+
+
+
+    std::string socket_path ()
+    {
+      //CONF option: MRPeekDaemonSocket
+      //CONF default: $XDG_RUNTIME_DIR/mrpeek.sock or /tmp/mrpeek-<uid>/mrpeek.sock
+      //CONF the location of the socket used to communicate with the mrpeek
+      //CONF render daemon.
+      std::string path = File::Config::get ("MRPeekDaemonSocket");
+      if (path.size())
+        return path;
+      const char* runtime_dir = getenv ("XDG_RUNTIME_DIR");
+      if (runtime_dir && *runtime_dir)
+        return std::string (runtime_dir) + "/mrpeek.sock";
+
+      // otherwise use a folder in /tmp only accessible to the current user,
+      // refusing to use it if anyone else could have created or modified it:
+      const std::string folder = "/tmp/mrpeek-" + str(getuid());
+      if (mkdir (folder.c_str(), 0700) && errno != EEXIST)
+        throw Exception ("error creating folder \"" + folder + "\" for mrpeek daemon socket: " + strerror (errno));
+      struct stat info;
+      if (lstat (folder.c_str(), &info) || !S_ISDIR (info.st_mode) || info.st_uid != getuid() || (info.st_mode & 0077))
+        throw Exception ("folder \"" + folder + "\" for mrpeek daemon socket is not private to the current user - refusing to use it");
+      return folder + "/mrpeek.sock";
+    }
+
+
+
+
+    int connect (const std::string& path)
+    {
+      int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+        return -1;
+      auto addr = socket_address (path);
+      if (::connect (fd, reinterpret_cast<sockaddr*> (&addr), sizeof(addr))) {
+        close (fd);
+        return -1;
+      }
+      if (!peer_is_current_user (fd)) {
+        close (fd);
+        WARN ("ignoring mrpeek daemon on \"" + path + "\" owned by another user");
+        return -1;
+      }
+      return fd;
+    }
+
+
+
+
+    void write_all (int fd, const char* data, size_t size)
+    {
+      while (size) {
+        ssize_t n = write (fd, data, size);
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          throw Exception (std::string ("error writing to socket: ") + strerror (errno));
+        }
+        data += n;
+        size -= n;
+      }
+    }
+
+
+
+
+    std::string read_all (int fd)
+    {
+      std::string out;
+      char buf[4096];
+      while (true) {
+        ssize_t n = read (fd, buf, sizeof(buf));
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          throw Exception (std::string ("error reading from socket: ") + strerror (errno));
+        }
+        if (n == 0)
+          return out;
+        out.append (buf, n);
+      }
+    }
+
+
+
+
+    void send_request (int fd, const std::string& request, std::ostream& out)
+    {
+      write_all (fd, request.data(), request.size());
+      shutdown (fd, SHUT_WR);
+
+      char buf[65536];
+      std::string error;
+      bool failed = false;
+      while (true) {
+        ssize_t n = read (fd, buf, sizeof(buf));
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          throw Exception (std::string ("error reading from mrpeek daemon: ") + strerror (errno));
+        }
+        if (n == 0)
+          break;
+        if (failed) {
+          error.append (buf, n);
+          continue;
+        }
+        const char* nul = static_cast<const char*> (memchr (buf, '\0', n));
+        if (nul) {
+          out.write (buf, nul-buf);
+          error.append (nul+1, buf+n-nul-1);
+          failed = true;
+        }
+        else
+          out.write (buf, n);
+      }
+      out.flush();
+
+      if (failed)
+        throw Exception ("mrpeek daemon: " + error);
+    }
+
+
+
+
+
+    Server::Server (const std::string& path) :
+      socket_path (path),
+      fd (-1)
+    {
+      // check whether a daemon is already listening, and remove stale socket if not:
+      int existing = connect (path);
+      if (existing >= 0) {
+        close (existing);
+        throw Exception ("an mrpeek daemon is already listening on \"" + path + "\"");
+      }
+      unlink (path.c_str());
+
+      // a client disconnecting early should not bring down the server:
+      signal (SIGPIPE, SIG_IGN);
+
+      fd = socket (AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+        throw Exception (std::string ("error creating socket: ") + strerror (errno));
+      auto addr = socket_address (path);
+      if (bind (fd, reinterpret_cast<sockaddr*> (&addr), sizeof(addr)) || listen (fd, 16)) {
+        close (fd);
+        throw Exception ("error listening on socket \"" + path + "\": " + strerror (errno));
+      }
+    }
+
+
+
+    Server::~Server ()
+    {
+      close (fd);
+      unlink (socket_path.c_str());
+    }
+
+
+
+    int Server::accept (int timeout_ms)
+    {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      while (true) {
+        int ret = poll (&pfd, 1, timeout_ms);
+        if (ret == 0)
+          return -1;
+        if (ret < 0) {
+          if (errno == EINTR)
+            continue;
+          throw Exception (std::string ("error waiting for connections: ") + strerror (errno));
+        }
+        int client = ::accept (fd, nullptr, nullptr);
+        if (client >= 0) {
+          if (peer_is_current_user (client))
+            return client;
+          WARN ("rejecting connection to mrpeek daemon from another user");
+          close (client);
+          continue;
+        }
+        if (errno != EINTR && errno != ECONNABORTED)
+          throw Exception (std::string ("error accepting connection: ") + strerror (errno));
+      }
+    }
+
+#endif
+
+  }
+}
+
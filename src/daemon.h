@@ -0,0 +1,92 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <streambuf>
+#include "mrtrix.h"
+
+
+// Support for running mrpeek as a persistent local render server: the
+// daemon listens on a Unix domain socket, and each client sends its request
+// as a single message, then receives the rendered output as a stream.
+// Clients signal the end of their request by shutting down their side of
+// the connection. Any error encountered by the server is reported by
+// sending a NUL byte followed by the error message - a NUL byte can never
+// occur within a valid sixel stream.
+
+namespace MR {
+  namespace Daemon {
+
+    // location of the socket used to communicate with the daemon:
+    std::string socket_path ();
+
+    // connect to a running daemon; returns -1 if none is listening, or if it
+    // is not run by the current user:
+    int connect (const std::string& path);
+
+    // write all of data to file descriptor, retrying as needed:
+    void write_all (int fd, const char* data, size_t size);
+
+    // read everything until end-of-file on the file descriptor:
+    std::string read_all (int fd);
+
+    // send request to daemon, and copy response to 'out':
+    void send_request (int fd, const std::string& request, std::ostream& out);
+
+
+
+    class Server
+    {
+      public:
+        Server (const std::string& path);
+        ~Server ();
+
+        // wait for the next client connection, for up to timeout_ms
+        // milliseconds; returns -1 on timeout:
+        int accept (int timeout_ms);
+
+        const std::string& path () const { return socket_path; }
+
+      private:
+        std::string socket_path;
+        int fd;
+    };
+
+
+
+    // stream buffer writing directly to a file descriptor, used to stream
+    // the rendered output back to the client:
+    class OutputBuffer : public std::streambuf
+    {
+      public:
+        OutputBuffer (int fd) : fd (fd) { setp (buf, buf + sizeof(buf)); }
+        ~OutputBuffer () { try { sync(); } catch (...) { } }
+
+      protected:
+        int_type overflow (int_type c) override {
+          flush_buffer();
+          if (c != traits_type::eof()) {
+            *pptr() = c;
+            pbump (1);
+          }
+          return traits_type::not_eof (c);
+        }
+        int sync () override {
+          flush_buffer();
+          return 0;
+        }
+
+      private:
+        int fd;
+        char buf[65536];
+
+        void flush_buffer () {
+          write_all (fd, pbase(), pptr() - pbase());
+          setp (buf, buf + sizeof(buf));
+        }
+    };
+
+  }
+}
+
+#endif
+
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+
+#ifndef MRTRIX_WINDOWS
+# include <unistd.h>
+# include <poll.h>
+#endif
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+#include "exception.h"
+#include "file/config.h"
+#include "image_io/base.h"
+#include "file_watcher.h"
+
+
+namespace MR {
+
+#ifndef MRTRIX_WINDOWS
+
+  namespace {
+
+    // split path into its folder and file name:
+    void split_path (const std::string& path, std::string& folder, std::string& name)
+    {
+      const size_t slash = path.rfind ('/');
+      folder = slash == std::string::npos ? "." : path.substr (0, std::max<size_t> (slash, 1));
+      name = slash == std::string::npos ? path : path.substr (slash+1);
+    }
+
+    // modification time & size of the files, with nothing listed for any
+    // that do not currently exist:
+    std::string file_state (const vector<std::string>& paths)
+    {
+      std::string state;
+      for (const auto& path : paths) {
+        struct stat s;
+        if (!stat (path.c_str(), &s))
+          state += str(s.st_mtime) + " " + str(s.st_size) + " " + str(s.st_ino);
+        state += ";";
+      }
+      return state;
+    }
+
+  }
+
+
+
+  FileWatcher::FileWatcher (const vector<std::string>& paths, int debounce_ms, std::function<void()> on_change) :
+    paths (paths), debounce_ms (debounce_ms), on_change (on_change), num_changes (0), notify_fd (-1)
+  {
+    if (pipe (stop_pipe))
+      throw Exception ("error creating pipe for file watcher: " + std::string (strerror (errno)));
+
+    // set up the watches before returning, so that no modification made
+    // from then on is missed:
+#ifdef __linux__
+    // (adding a watch for the same directory again returns the same descriptor)
+    notify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    for (const auto& path : paths) {
+      if (notify_fd < 0)
+        break;
+      std::string folder, name;
+      split_path (path, folder, name);
+      const int wd = inotify_add_watch (notify_fd, folder.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE);
+      if (wd < 0) {
+        close (notify_fd);
+        notify_fd = -1;
+      }
+      else
+        names[wd].insert (name);
+    }
+#endif
+    state = file_state (paths);
+
+    thread = std::thread (&FileWatcher::run, this);
+  }
+
+
+
+  FileWatcher::~FileWatcher ()
+  {
+    const char c = 0;
+    if (write (stop_pipe[1], &c, 1)) { }
+    thread.join();
+    close (stop_pipe[0]);
+    close (stop_pipe[1]);
+    if (notify_fd >= 0)
+      close (notify_fd);
+  }
+
+
+
+  void FileWatcher::run ()
+  {
+    struct pollfd pfd[2];
+    pfd[0].fd = stop_pipe[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = notify_fd;
+    pfd[1].events = POLLIN;
+
+    //CONF option: MRPeekWatchPollInterval
+    //CONF default: 250
+    //CONF the interval (in ms) at which mrpeek -watch checks the image for
+    //CONF modifications where inotify is not available.
+    const int poll_interval = pfd[1].fd >= 0 ? -1 : std::max (1, File::Config::get_int ("MRPeekWatchPollInterval", 250));
+    bool pending = false;
+
+    while (true) {
+      // while a modification is pending, wait for the burst to end:
+      const int timeout = pending ? debounce_ms : poll_interval;
+      const int n = poll (pfd, pfd[1].fd >= 0 ? 2 : 1, timeout);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (pfd[0].revents)
+        break;
+
+      if (n == 0) {
+        if (pending) {
+          pending = false;
+          ++num_changes;
+          on_change();
+        }
+        else if (poll_interval >= 0) {
+          const std::string current = file_state (paths);
+          if (current != state) {
+            state = current;
+            pending = true;
+          }
+        }
+        continue;
+      }
+
+#ifdef __linux__
+      if (pfd[1].revents & POLLIN) {
+        alignas(struct inotify_event) char buf[4096];
+        ssize_t len;
+        while ((len = read (pfd[1].fd, buf, sizeof(buf))) > 0) {
+          for (char* p = buf; p < buf + len; ) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*> (p);
+            if (event->len) {
+              auto watched = names.find (event->wd);
+              if (watched != names.end() && watched->second.count (event->name))
+                pending = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+          }
+        }
+      }
+#endif
+    }
+  }
+
+#else
+
+  FileWatcher::FileWatcher (const vector<std::string>& paths, int debounce_ms, std::function<void()> on_change) :
+    paths (paths), debounce_ms (debounce_ms), on_change (on_change), num_changes (0)
+  {
+    throw Exception ("watching files for modifications is not supported on Windows");
+  }
+
+  FileWatcher::~FileWatcher () { }
+
+  void FileWatcher::run () { }
+
+#endif
+
+
+
+  vector<std::string> image_files (const std::string& path, const Header& header)
+  {
+    vector<std::string> files (1, path);
+    if (header.get_io()) {
+      for (const auto& entry : header.get_io()->files) {
+        if (std::find (files.begin(), files.end(), entry.name) == files.end())
+          files.push_back (entry.name);
+      }
+    }
+    return files;
+  }
+
+}
+
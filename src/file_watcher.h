@@ -0,0 +1,60 @@
+#ifndef __FILE_WATCHER_H__
+#define __FILE_WATCHER_H__
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <set>
+#include <thread>
+#include "mrtrix.h"
+#include "header.h"
+
+
+// Detection of modifications to files on disk, e.g. an image that is being
+// rewritten by another process. On Linux, the directories holding the files
+// are monitored using inotify, so that a file being replaced (e.g. written to
+// a temporary file and renamed) is detected as well as it being rewritten in
+// place. Elsewhere, the modification time and size of the files are polled.
+//
+// Modifications tend to come in bursts (e.g. one event per block written),
+// so they are debounced: the callback is only invoked once no further
+// modification has been detected for 'debounce_ms' milliseconds. The
+// callback is invoked from the watcher's own thread. Any modification made
+// once the watcher has been constructed is detected.
+
+namespace MR {
+
+  class FileWatcher
+  {
+    public:
+      FileWatcher (const vector<std::string>& paths, int debounce_ms, std::function<void()> on_change);
+      ~FileWatcher ();
+
+      // number of (debounced) modifications detected so far:
+      size_t changes () const { return num_changes; }
+
+    private:
+      const vector<std::string> paths;
+      const int debounce_ms;
+      std::function<void()> on_change;
+      std::atomic<size_t> num_changes;
+      int stop_pipe[2];
+      int notify_fd;  // inotify instance, or -1 if polling
+      std::map<int,std::set<std::string>> names;  // files watched in each directory watched
+      std::string state;  // as last polled
+      std::thread thread;
+
+      void run ();
+  };
+
+
+
+  // all files holding the image opened from 'path' with 'header': the file
+  // it was opened from, along with any separate data files (e.g. for .mih
+  // or NIfTI .hdr/.img pairs):
+  vector<std::string> image_files (const std::string& path, const Header& header);
+
+}
+
+#endif
+
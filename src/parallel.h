@@ -0,0 +1,79 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <atomic>
+#include "thread.h"
+
+
+namespace MR {
+
+  // whether the calling thread is one of several sharing out work (the
+  // threads of a parallel_for, or e.g. those of the batch renderer), in which
+  // case any nested parallel_for runs serially rather than spawning yet more
+  // threads:
+  inline bool& in_parallel_region () {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+  // mark the calling thread as within a parallel region for its lifetime:
+  class ParallelRegion {
+    public:
+      ParallelRegion () : previous (in_parallel_region()) { in_parallel_region() = true; }
+      ~ParallelRegion () { in_parallel_region() = previous; }
+    private:
+      const bool previous;
+  };
+
+
+
+  namespace {
+
+    template <class Functor>
+      class ParallelFor {
+        public:
+          ParallelFor (const Functor& functor, std::atomic<size_t>& next, size_t num) :
+            functor (functor), next (next), num (num) { }
+
+          void execute () {
+            ParallelRegion region;
+            size_t n;
+            while ((n = next++) < num)
+              functor (n);
+          }
+
+        private:
+          Functor functor;
+          std::atomic<size_t>& next;
+          const size_t num;
+      };
+
+  }
+
+
+  // invoke functor(n) for each n in [0,num), with items handed out
+  // dynamically to the threads as they become available. Each thread
+  // operates on its own copy of the functor, which can therefore hold
+  // per-thread state (e.g. interpolators) by value. Items must be
+  // independent of each other. Within a parallel region, the items are
+  // processed on the calling thread.
+  template <class Functor>
+    void parallel_for (size_t num, const Functor& functor, size_t nthreads = Thread::number_of_threads())
+    {
+      nthreads = std::min (nthreads, num);
+      if (nthreads <= 1 || in_parallel_region()) {
+        Functor f (functor);
+        for (size_t n = 0; n < num; ++n)
+          f (n);
+        return;
+      }
+
+      std::atomic<size_t> next (0);
+      ParallelFor<Functor> loop (functor, next, num);
+      Thread::run (Thread::multi (loop, nthreads), "parallel for");
+    }
+
+}
+
+#endif
+
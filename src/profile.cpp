@@ -0,0 +1,157 @@
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#include "profile.h"
+
+
+namespace MR {
+  namespace Profile {
+
+    const char* stage_names[] = { "regrid", "render", "autoscale", "encode", "flush" };
+
+    namespace {
+
+      // small integer identifying the calling thread in the trace:
+      int thread_number ()
+      {
+        static std::atomic<int> count (0);
+        thread_local int number = ++count;
+        return number;
+      }
+
+      double microseconds (clock::duration d)
+      {
+        return std::chrono::duration<double, std::micro> (d).count();
+      }
+
+    }
+
+
+
+    Profiler::Profiler (const std::string& trace_path) :
+      origin (clock::now()), last_bytes (0), num_frames (0), num_events (0), frame_started (false)
+    {
+      for (int n = 0; n < N_STAGES; ++n) {
+        current[n] = 0;
+        last[n] = 0;
+      }
+      if (trace_path.size()) {
+        trace.open (trace_path);
+        trace << std::fixed << std::setprecision (3) << "{\"traceEvents\":[";
+      }
+    }
+
+
+
+    Profiler::~Profiler ()
+    {
+      if (trace.is_open())
+        trace << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    }
+
+
+
+    void Profiler::write_event (const char* name, clock::time_point start, clock::time_point end, const std::string& args)
+    {
+      trace << (num_events++ ? ",\n" : "\n")
+        << "{\"name\":\"" << name << "\",\"cat\":\"mrpeek\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread_number()
+        << ",\"ts\":" << microseconds (start - origin) << ",\"dur\":" << microseconds (end - start);
+      if (args.size())
+        trace << ",\"args\":{" << args << "}";
+      trace << "}";
+    }
+
+
+
+    void Profiler::add (Stage stage, clock::time_point start, clock::time_point end, clock::duration exclusive)
+    {
+      current[stage] += std::chrono::duration_cast<std::chrono::nanoseconds> (exclusive).count();
+      if (trace.is_open()) {
+        std::lock_guard<std::mutex> lock (mutex);
+        if (!frame_started || start < frame_start) {
+          frame_start = start;
+          frame_started = true;
+        }
+        write_event (stage_names[stage], start, end);
+      }
+    }
+
+
+
+    void Profiler::finish (size_t bytes)
+    {
+      const auto now = clock::now();
+      std::lock_guard<std::mutex> lock (mutex);
+      for (int n = 0; n < N_STAGES; ++n)
+        last[n] = current[n].exchange (0);
+      last_bytes = bytes;
+
+      // the frame rate is measured over the frames completed within the last
+      // second, or over the last two frames if these are further apart:
+      recent.push_back (now);
+      while (recent.size() > 2 && now - recent.front() > std::chrono::seconds (1))
+        recent.pop_front();
+
+      if (trace.is_open()) {
+        write_event ("frame", frame_started ? frame_start : now, now,
+            "\"frame\":" + str(num_frames) + ",\"bytes\":" + str(bytes));
+        frame_started = false;
+        trace.flush();
+      }
+      ++num_frames;
+    }
+
+
+
+    double Profiler::time (Stage stage) const
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      return last[stage] * 1.0e-9;
+    }
+
+
+
+    size_t Profiler::bytes () const
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      return last_bytes;
+    }
+
+
+
+    std::string Profiler::summary () const
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      std::ostringstream out;
+      out << std::fixed << std::setprecision (1);
+      for (int n = 0; n < N_STAGES; ++n)
+        out << stage_names[n] << " " << last[n] * 1.0e-6 << " ";
+      out << "ms | " << last_bytes / 1024.0 << " kB";
+      if (recent.size() > 1)
+        out << " | " << (recent.size() - 1) / std::chrono::duration<double> (recent.back() - recent.front()).count() << " fps";
+      return out.str();
+    }
+
+
+
+    void Timer::stop ()
+    {
+      const auto end = clock::now();
+      const auto elapsed = end - start;
+      profiler->add (stage, start, end, elapsed - nested);
+      if (parent)
+        parent->nested += elapsed;
+      innermost() = parent;
+    }
+
+
+
+    Timer*& Timer::innermost ()
+    {
+      thread_local Timer* timer = nullptr;
+      return timer;
+    }
+
+  }
+}
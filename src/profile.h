@@ -0,0 +1,98 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include "mrtrix.h"
+#include "file/ofstream.h"
+
+
+// Timing of the stages of the rendering pipeline, to find out where the time
+// taken by a slow frame went. Each stage is timed by a scoped Timer, which
+// adds the time to the totals of the frame currently being produced, and to
+// the trace file if one was requested, in the Chrome trace event format (as
+// shown by chrome://tracing or https://ui.perfetto.dev).
+//
+// A Timer constructed with a null Profiler does nothing, so that the cost of
+// the instrumentation when profiling is disabled is that of a pointer test.
+// Time spent in nested timers is only counted towards the innermost stage,
+// while stages running concurrently on several threads (e.g. the panels of
+// the orthoview) are summed over all threads.
+
+namespace MR {
+  namespace Profile {
+
+    enum Stage { REGRID, RENDER, AUTOSCALE, ENCODE, FLUSH, N_STAGES };
+    extern const char* stage_names[];
+
+    using clock = std::chrono::steady_clock;
+
+
+
+    class Profiler
+    {
+      public:
+        // trace written to 'trace_path', if not empty:
+        Profiler (const std::string& trace_path = std::string());
+        ~Profiler ();
+
+        // record an interval of 'exclusive' seconds (excluding nested stages) spent in 'stage':
+        void add (Stage stage, clock::time_point start, clock::time_point end, clock::duration exclusive);
+        // mark the frame as complete, once its 'bytes' bytes have been written out:
+        void finish (size_t bytes);
+
+        // time spent in 'stage' (in seconds) and size of the last complete frame:
+        double time (Stage stage) const;
+        size_t bytes () const;
+        // per-stage timings & size of the last complete frame, and the current frame rate:
+        std::string summary () const;
+        bool tracing () const { return trace.is_open(); }
+
+      private:
+        const clock::time_point origin;
+        std::atomic<int64_t> current[N_STAGES];  // in ns, for the frame in progress
+        int64_t last[N_STAGES];
+        size_t last_bytes, num_frames;
+        std::deque<clock::time_point> recent;  // completion times of the most recent frames
+        mutable std::mutex mutex;
+
+        File::OFStream trace;
+        size_t num_events;
+        bool frame_started;
+        clock::time_point frame_start;
+        void write_event (const char* name, clock::time_point start, clock::time_point end, const std::string& args = std::string());
+    };
+
+
+
+    class Timer
+    {
+      public:
+        Timer (Profiler* profiler, Stage stage) : profiler (profiler), stage (stage) {
+          if (profiler) {
+            parent = innermost();
+            innermost() = this;
+            start = clock::now();
+          }
+        }
+        ~Timer () { if (profiler) stop(); }
+
+      private:
+        Profiler* profiler;
+        const Stage stage;
+        Timer* parent;
+        clock::time_point start;
+        clock::duration nested = clock::duration::zero();
+
+        void stop ();
+        // the timer currently running on this thread, if any:
+        static Timer*& innermost ();
+    };
+
+  }
+}
+
+#endif
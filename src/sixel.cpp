@@ -1,3 +1,6 @@
+#include <algorithm>
+
+#include "file/config.h"
 #include "sixel.h"
 
 namespace MR {
@@ -5,41 +8,85 @@ namespace MR {
 
     namespace {
       bool need_newline_after_sixel = true;
+
+      bool use_implicit_background ()
+      {
+        //CONF option: MRPeekSixelImplicitBackground
+        //CONF default: 0 (false)
+        //CONF whether to leave pixels of the most common colour in each frame
+        //CONF (usually the image background) to the background fill of the
+        //CONF sixel image, rather than painting them in a single run per band
+        //CONF of six rows. This makes the output slightly smaller, but is only
+        //CONF displayed correctly by terminals that fill the area given by the
+        //CONF sixel raster attributes with colour register 0.
+        static const bool implicit = File::Config::get_bool ("MRPeekSixelImplicitBackground", false);
+        return implicit;
+      }
     }
 
-    std::string CMap::specifier () const {
-      std::string out;
-      if (ID<0)
-        return out;
+    std::array<int,3> CMap::colour (int n) const {
       const auto& map_fn = ::MR::ColourMap::maps[ID].basic_mapping;
-      for (int n = 0; n <= ncolours; ++n) {
-        const Eigen::Array3f colour = 100.0f*map_fn (float(n)/ncolours);
-        out += "#"+str(index+n)+";2;"+
-          str(std::round(colour[0]))+";"+
-          str(std::round(colour[1]))+";"+
-          str(std::round(colour[2]));
+      const Eigen::Array3f colour = 100.0f*map_fn (float(n)/ncolours);
+      return { { int (std::round (colour[0])), int (std::round (colour[1])), int (std::round (colour[2])) } };
+    }
+
+
+
+
+    bool ColourMaps::colour (int index, std::array<int,3>& rgb) const {
+      for (const auto& c : cmaps) {
+        if (index >= c.index && index <= c.last_index()) {
+          if (c.ID < 0) {
+            if (index - c.index >= int (fixed_colours.size()))
+              return false;
+            rgb = fixed_colours[index - c.index];
+          }
+          else
+            rgb = c.colour (index - c.index);
+          return true;
+        }
       }
-      return out;
+      return false;
     }
 
 
 
 
+    void Encoder::write (std::ostream& out) {
+      size_t counts[256] = { };
+      for (const auto c : data)
+        ++counts[c];
 
+      // the most common colour (usually the image background) is held in
+      // colour register 0, and painted over each band in a single run before
+      // the other colours are painted over it, so that its pixels need not be
+      // encoded individually. With the implicit background, even that run is
+      // left to the terminal's fill of the area given by the raster attributes:
+      background = std::max_element (counts, counts+256) - counts;
+      implicit_background = use_implicit_background();
+      if (implicit_background)
+        out << SixelStartFilled << "\"1;1;" << x_dim << ";" << y_dim;
+      else
+        out << SixelStart;
 
-    std::string Encoder::write () {
-      std::string out = SixelStart + colourmap.specifier();
+      // only define the colours actually used in this frame (the canvas
+      // holds 8-bit indices, so none can exceed 255):
+      std::array<int,3> rgb;
+      for (int index = 0; index <= std::min (colourmap.maximum(), 255); ++index) {
+        if (counts[index] && colourmap.colour (index, rgb))
+          out << "#" << colour_register (index, background) << ";2;" << rgb[0] << ";" << rgb[1] << ";" << rgb[2];
+      }
 
-      int y = 0;
-      for (; y < y_dim; y += 6)
-        out += encode (y);
+      for (int y = 0; y < y_dim; y += 6) {
+        band.clear();
+        encode (y);
+        out << band;
+      }
 
-      out += SixelStop;
+      out << SixelStop;
 
       if (need_newline_after_sixel)
-        out += VT::move_cursor (VT::Down,1) + VT::CarriageReturn;
-
-      return out;
+        out << VT::move_cursor (VT::Down,1) << VT::CarriageReturn;
     }
 
 
@@ -47,35 +94,108 @@ namespace MR {
 
 
 
-    std::string Encoder::encode (int y0) {
+    void Encoder::encode (int y0) {
       const int nsixels = std::min (y_dim-y0, 6);
-      std::string out;
-
-      for (int intensity = 0; intensity <= colourmap.maximum(); ++intensity) {
-        for (int i = y0*x_dim; i < (y0+nsixels)*x_dim; ++i) {
-          // if any voxel in buffer has this intensity, then need to encode the
-          // whole row of sixels:
-          if (data[i] == intensity) {
-            out += encode (y0, intensity);
-            break;
+
+      // find the runs of columns over which each intensity is present in the
+      // band, in a single pass over its pixels. Runs separated by only a few
+      // blank columns are merged, since encoding the gap is cheaper than
+      // selecting the colour again:
+      constexpr int max_gap = 4;
+      int x0[256], x1[256];
+      std::fill (x0, x0+256, -1);
+      spans.clear();
+      const uint8_t* band_data = &data[size_t(y0)*x_dim];
+      for (int x = 0; x < x_dim; ++x) {
+        for (int y = 0; y < nsixels; ++y) {
+          const uint8_t c = band_data[x+y*x_dim];
+          if (x0[c] < 0)
+            x0[c] = x;
+          else if (x - x1[c] > max_gap) {
+            spans.push_back ({ x0[c], x1[c], c });
+            x0[c] = x;
           }
+          x1[c] = x;
         }
       }
-      // replace last character from $ (carriage return) to '-' (newline):
-      out.back() = '-';
-      return out;
+      for (int intensity = 0; intensity < 256; ++intensity) {
+        if (x0[intensity] >= 0)
+          spans.push_back ({ x0[intensity], x1[intensity], intensity });
+      }
+      spans.erase (std::remove_if (spans.begin(), spans.end(),
+            [&] (const Span& span) { return span.intensity == background; }), spans.end());
+      std::stable_sort (spans.begin(), spans.end());
+
+      if (!implicit_background && x0[background] >= 0) {
+        band += "#0";
+        clear();
+        current = (1U << nsixels) - 1;
+        repeats = x_dim;
+        commit();
+        band += '$';
+      }
+
+      // runs that do not overlap can share the same row of sixels, switching
+      // colour along the way. Taking them in order of their first column,
+      // place each on the row that ended closest before it, so that as few
+      // rows (each needing a carriage return and a run of blank sixels up
+      // to its first column) and blank columns as possible are encoded:
+      for (auto& row : rows)
+        row.clear();
+      row_end.clear();
+      for (int n = 0; n < int (spans.size()); ++n) {
+        int best = -1;
+        for (int r = 0; r < int (row_end.size()); ++r) {
+          if (row_end[r] < spans[n].x0 && ( best < 0 || row_end[r] > row_end[best] ))
+            best = r;
+        }
+        if (best < 0) {
+          best = row_end.size();
+          row_end.push_back (0);
+          if (rows.size() < row_end.size())
+            rows.emplace_back();
+        }
+        rows[best].push_back (n);
+        row_end[best] = spans[n].x1;
+      }
+
+      for (size_t r = 0; r < row_end.size(); ++r) {
+        int x = 0, intensity = -1;
+        clear();
+        for (const auto n : rows[r]) {
+          const auto& span = spans[n];
+          if (span.intensity != intensity) {
+            commit();
+            clear();
+            intensity = span.intensity;
+            band += "#" + str(colour_register (intensity, background));
+          }
+          for (; x < span.x0; ++x)
+            add (0);
+          encode (y0, intensity, span.x0, span.x1);
+          x = span.x1 + 1;
+        }
+        commit();
+        band += '$';
+      }
+
+      // replace last character from $ (carriage return) to '-' (newline), or
+      // simply move down if the band is all background:
+      if (band.empty())
+        band += '-';
+      else
+        band.back() = '-';
     }
 
 
 
 
 
-    std::string Encoder::encode (const int y0, const int intensity)
+
+    void Encoder::encode (const int y0, const int intensity, const int x0, const int x1)
     {
       const int nsixels = std::min (y_dim-y0, 6);
-      std::string out;
-      clear();
-      for (int x = 0; x < x_dim; ++x) {
+      for (int x = x0; x <= x1; ++x) {
         const int index = x + y0*x_dim;
         uint8_t s = 0;
         switch (nsixels) {
@@ -89,9 +209,101 @@ namespace MR {
         }
         add (s);
       }
-      commit (true);
-      out += "#" + str(intensity) + buffer + '$';
-      return out;
+    }
+
+
+
+
+
+
+    void decode (const std::string& sixel, int x_dim, int y_dim,
+        std::vector<uint8_t>& canvas, std::vector<std::array<int,3>>& palette)
+    {
+      size_t n = sixel.find ("\033P");
+      if (n != std::string::npos)
+        n = sixel.find ('q', n);
+      if (n == std::string::npos)
+        throw Exception ("no sixel data found");
+
+      canvas.assign (size_t(x_dim)*y_dim, 0);
+      palette.assign (256, { { 0, 0, 0 } });
+      int x = 0, y = 0, colour = 0;
+
+      auto is_digit = [&] () { return n < sixel.size() && sixel[n] >= '0' && sixel[n] <= '9'; };
+      auto number = [&] () {
+        if (!is_digit())
+          throw Exception ("missing number in sixel data");
+        int value = 0;
+        while (is_digit())
+          value = 10*value + sixel[n++] - '0';
+        return value;
+      };
+      auto skip_parameters = [&] () {
+        while (n < sixel.size() && (sixel[n] == ';' || is_digit()))
+          ++n;
+      };
+      auto parameter = [&] () {
+        if (n >= sixel.size() || sixel[n] != ';')
+          throw Exception ("missing parameter in sixel data");
+        ++n;
+        return number();
+      };
+      auto paint = [&] (char c, int count) {
+        if (c < 63 || c > 126)
+          throw Exception ("invalid sixel character in sixel data");
+        const int bits = c - 63;
+        for (int i = 0; i < count; ++i, ++x) {
+          for (int b = 0; b < 6; ++b) {
+            if (bits & (1<<b)) {
+              if (x >= x_dim || y+b >= y_dim)
+                throw Exception ("sixel data painted outside of canvas");
+              canvas[x + size_t(y+b)*x_dim] = colour;
+            }
+          }
+        }
+      };
+
+      ++n;
+      while (n < sixel.size()) {
+        const char c = sixel[n];
+        if (c == '\033')  // string terminator
+          return;
+        if (c == '#') {  // colour selection, or definition if followed by parameters
+          ++n;
+          colour = number();
+          if (colour > 255)
+            throw Exception ("invalid colour register in sixel data");
+          if (n < sixel.size() && sixel[n] == ';') {
+            if (parameter() != 2)
+              throw Exception ("unsupported colour coordinate system in sixel data");
+            for (auto& c : palette[colour])
+              c = parameter();
+          }
+        }
+        else if (c == '!') {  // repeated sixel
+          ++n;
+          const int count = number();
+          if (n >= sixel.size())
+            break;
+          paint (sixel[n++], count);
+        }
+        else if (c == '"') {  // raster attributes
+          ++n;
+          skip_parameters();
+        }
+        else {
+          if (c == '$')
+            x = 0;
+          else if (c == '-') {
+            x = 0;
+            y += 6;
+          }
+          else
+            paint (c, 1);
+          ++n;
+        }
+      }
+      throw Exception ("unterminated sixel data");
     }
 
 
@@ -165,6 +377,50 @@ namespace MR {
       need_newline_after_sixel = (row==1);
     }
 
+
+
+
+    void query_window_size (int& width, int& height, int& line_height)
+    {
+      // not all terminals respond to these queries: follow them with a
+      // device attributes query, which all terminals respond to, so we know
+      // when to stop waiting:
+      struct CallBack : public VT::EventLoop::CallBack
+      {
+        bool operator() (int event, const std::vector<int>& param) override {
+          if (!event) {
+            if (!sent) {
+              std::cout << VT::RequestWindowSizePixels << VT::RequestCellSizePixels
+                << VT::RequestWindowSizeChars << VT::QueryIsSixelSupported;
+              std::cout.flush();
+              sent = true;
+            }
+            return true;
+          }
+          if (event == (VT::CSImask | 't') && param.size() == 3) {
+            switch (param[0]) {
+              case 4: window[0] = param[2]; window[1] = param[1]; break;
+              case 6: cell[0] = param[2]; cell[1] = param[1]; break;
+              case 8: chars[0] = param[2]; chars[1] = param[1]; break;
+              default: break;
+            }
+            return true;
+          }
+          return event != (VT::CSImask | 'c') && event != 'q';
+        }
+        bool sent = false;
+        int window[2] = { 0, 0 }, cell[2] = { 0, 0 }, chars[2] = { 0, 0 };
+      } callback;
+
+      VT::EventLoop (callback).run();
+
+      width = callback.window[0] ? callback.window[0] : callback.cell[0] * callback.chars[0];
+      height = callback.window[1] ? callback.window[1] : callback.cell[1] * callback.chars[1];
+      line_height = callback.cell[1];
+      if (!line_height && callback.chars[1])
+        line_height = height / callback.chars[1];
+    }
+
   }
 }
 
@@ -18,11 +18,25 @@ namespace MR {
     constexpr float ContrastIncrement = 0.03f;
 
     constexpr const char* SixelStart = "\033P9;1q$";
+    // as above, but with pixels not painted set to colour 0, over the area
+    // given by the raster attributes that must follow:
+    constexpr const char* SixelStartFilled = "\033P9;0q";
     constexpr const char* SixelStop = "\033\\";
 
     void check_sixel_support ();
     void init();
 
+    // query the size of the terminal window in pixels, and the height of a
+    // line of text. Values not reported by the terminal are set to zero:
+    void query_window_size (int& width, int& height, int& line_height);
+
+    // decode a sixel stream as written by Encoder::write() back into the
+    // colour registers of a canvas of the given size (e.g. to verify the
+    // encoding), with pixels that are not painted left at zero, and the
+    // colours (in percent) these registers were set to:
+    void decode (const std::string& sixel, int x_dim, int y_dim,
+        std::vector<uint8_t>& canvas, std::vector<std::array<int,3>>& palette);
+
 
 
 
@@ -66,7 +80,8 @@ namespace MR {
         int levels () const { return ncolours; }
 
         int last_index () const { return index + ncolours; }
-        std::string specifier () const;
+        // colour (in percent) of entry 'n' of this colourmap:
+        std::array<int,3> colour (int n) const;
 
         int ID, index;
 
@@ -80,6 +95,15 @@ namespace MR {
 
 
 
+    // the colour register used for a given colour index: the background
+    // colour is held in register zero, which fills the area of the image not
+    // otherwise painted, and the colour normally at index zero takes its place:
+    inline int colour_register (int index, int background) {
+      return index == background ? 0 : ( index == 0 ? background : index );
+    }
+
+
+
     class ColourMaps {
       public:
         void add (int colourmap_ID, int num_colours) {
@@ -88,30 +112,20 @@ namespace MR {
 
         void add (const std::vector<std::array<int, 3>>& colours) {
           assert (cmaps.empty());
-          fixed_cmap_specifier.clear();
+          fixed_colours = colours;
           cmaps.push_back ({ -1, 0, int(colours.size()) });
-          for (size_t n = 0; n < colours.size(); ++n) {
-            fixed_cmap_specifier += "#"+str(n)+";2;"+
-              str(colours[n][0])+";"+
-              str(colours[n][1])+";"+
-              str(colours[n][2]);
-          }
         }
         int size () const { return cmaps.size(); }
         const CMap& operator[] (int n) const { return cmaps[n]; }
         CMap& operator[] (int n) { return cmaps[n]; }
 
-        std::string specifier () const {
-          std::string out = fixed_cmap_specifier;
-          for (const auto& c : cmaps)
-            out += c.specifier();
-          return out;
-        }
+        // colour (in percent) of the given index, and whether it is defined:
+        bool colour (int index, std::array<int,3>& rgb) const;
         const int maximum () const { return cmaps.back().last_index(); }
 
       private:
         std::vector<CMap> cmaps;
-        std::string fixed_cmap_specifier;
+        std::vector<std::array<int,3>> fixed_colours;
 
         int next_index () const {
           return cmaps.size() ? cmaps.back().last_index()+1 : 0;
@@ -175,14 +189,45 @@ namespace MR {
           y_dim (y_dim),
           data (x_dim*y_dim, 0),
           current (255),
-          repeats (0) {
+          repeats (0),
+          background (0),
+          implicit_background (false) {
 #ifndef NDEBUG
             data_debug = &data[0]; std::cerr << "canvas: " << x_dim << " " << y_dim << "\n";
 #endif
           }
 
-        // once slice is fully specified, encode and write to string:
-        std::string write ();
+        // as above, but reusing the storage held by 'canvas' (e.g. released
+        // by the encoder for a previous frame) rather than allocating anew:
+        Encoder (int x_dim, int y_dim, const ColourMaps& colourmap, std::vector<uint8_t>&& canvas) :
+          colourmap (colourmap),
+          x_dim (x_dim),
+          y_dim (y_dim),
+          data (std::move (canvas)),
+          current (255),
+          repeats (0),
+          background (0),
+          implicit_background (false) {
+            data.assign (size_t(x_dim)*y_dim, 0);
+#ifndef NDEBUG
+            data_debug = &data[0]; std::cerr << "canvas: " << x_dim << " " << y_dim << "\n";
+#endif
+          }
+
+        // hand back the storage of the canvas for reuse, once written:
+        std::vector<uint8_t> release () { return std::move (data); }
+
+        // once slice is fully specified, encode and write to stream. Each
+        // band of sixels is sent to the stream as soon as it is encoded, so
+        // only one band is ever held in memory:
+        void write (std::ostream& out);
+
+        // convenience version: encode the whole frame into a string:
+        std::string write () {
+          std::ostringstream out;
+          write (out);
+          return out.str();
+        }
 
         ViewPort viewport (int x, int y, int size_x = -1, int size_y = -1) {
           if (size_x < 0) size_x = x_dim-x;
@@ -199,13 +244,32 @@ namespace MR {
         const ColourMaps& colourmap;
         int x_dim, y_dim;
         std::vector<uint8_t> data;
-        std::string buffer;
+        std::string band;
         uint8_t current;
         int repeats;
 
-        std::string encode (int y0);
-
-        std::string encode (const int y0, const int intensity);
+        // the colour index held in colour register zero, and whether pixels
+        // of that colour are left to the background fill rather than painted
+        // explicitly:
+        int background;
+        bool implicit_background;
+
+        // runs of columns over which a colour is present within the current
+        // band, and the runs to encode on each row of sixels (i.e. between
+        // carriage returns), in order:
+        struct Span {
+          int x0, x1, intensity;
+          bool operator< (const Span& other) const { return x0 < other.x0; }
+        };
+        std::vector<Span> spans;
+        std::vector<std::vector<int>> rows;
+        std::vector<int> row_end;
+
+        // encode band of sixels starting at row y0 into 'band':
+        void encode (int y0);
+
+        // encode sixels of colour 'intensity' for columns x0 to x1 (inclusive):
+        void encode (const int y0, const int intensity, const int x0, const int x1);
 
         void add (uint8_t c) {
           if (c == current)
@@ -218,20 +282,17 @@ namespace MR {
         }
 
         void clear () {
-          buffer.clear();
           repeats = 0;
           current = 255;
         }
 
-        void commit (bool is_last = false) {
-          if (is_last && current == 0)
-            return;
+        void commit () {
           switch (repeats) {
             case 0: break;
-            case 3: buffer += char (63+current);
-            case 2: buffer += char (63+current);
-            case 1: buffer += char (63+current); break;
-            default: buffer += '!'+str(repeats)+char(63+current);
+            case 3: band += char (63+current);
+            case 2: band += char (63+current);
+            case 1: band += char (63+current); break;
+            default: band += '!'+str(repeats)+char(63+current);
           }
         }
     };
@@ -0,0 +1,1791 @@
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "file/config.h"
+#include "thread.h"
+#include "timer.h"
+#include "transform.h"
+#include "algo/loop.h"
+
+#include "parallel.h"
+#include "view.h"
+
+
+namespace MR {
+  namespace Render {
+
+    using namespace VT;
+
+    const char* projection_modes[] = { "none", "max", "min", "mean", nullptr };
+    const char* projection_names[] = { "", "maximum", "minimum", "mean" };
+    const char* temporal_stat_choices[] = { "none", "mean", "std", "tsnr", nullptr };
+    const char* labels_mode_choices[] = { "none", "fill", "outline", nullptr };
+
+
+
+
+    // Cache of the time series in the neighbourhood of the focus, stored in
+    // voxel-major order (all volumes of each voxel contiguous in memory). This
+    // avoids re-reading one value per volume, with a stride of an entire
+    // volume, every time the plot along the volume axis is redrawn. The cache
+    // is filled by a single pass through the volumes on a background thread,
+    // and the event loop is woken up once it is ready.
+    class TimeSeriesCache
+    {
+      public:
+        TimeSeriesCache () : ready (false), cancel (false) { }
+        ~TimeSeriesCache () { stop(); }
+
+        // copy the time series along 'axis' at 'position' into 'series' if it
+        // is held in the cache. Otherwise, start filling the cache around
+        // 'position' in the background, and return false:
+        bool get (const ImageType& image, int axis, const vector<int>& position, vector<value_type>& series)
+        {
+          std::string image_key = image.name() + " " + str(axis);
+          for (size_t n = 3; n < image.ndim(); ++n)
+            if (int(n) != axis)
+              image_key += " " + str(image.index(n));
+
+          if (image_key == key && inside (position)) {
+            if (!ready)
+              return false;
+            const size_t offset = (((position[2]-from[2])*dim[1] + (position[1]-from[1]))*dim[0] + (position[0]-from[0])) * nvols;
+            std::copy (data.begin() + offset, data.begin() + offset + nvols, series.begin());
+            return true;
+          }
+
+          stop();
+          key = image_key;
+          nvols = image.size (axis);
+          //CONF option: MRPeekTimeSeriesCacheRadius
+          //CONF default: 8
+          //CONF the radius (in voxels) of the neighbourhood around the focus for
+          //CONF which time series are cached when plotting along the volume axis.
+          const int radius = File::Config::get_int ("MRPeekTimeSeriesCacheRadius", 8);
+          for (int n = 0; n < 3; ++n) {
+            from[n] = std::max (position[n] - radius, 0);
+            dim[n] = std::min<int> (position[n] + radius + 1, image.size(n)) - from[n];
+          }
+          data.resize (size_t(dim[0])*dim[1]*dim[2]*nvols);
+          cancel = false;
+          thread = std::thread (&TimeSeriesCache::fill, this, image, axis);
+          return false;
+        }
+
+        size_t bytes () const { return data.size() * sizeof(value_type); }
+
+      private:
+        std::string key;
+        int from[3], dim[3], nvols;
+        vector<value_type> data;
+        std::atomic<bool> ready, cancel;
+        std::thread thread;
+
+        bool inside (const vector<int>& position) const {
+          for (int n = 0; n < 3; ++n)
+            if (position[n] < from[n] || position[n] >= from[n] + dim[n])
+              return false;
+          return true;
+        }
+
+        void stop () {
+          cancel = true;
+          if (thread.joinable())
+            thread.join();
+          ready = false;
+        }
+
+        // volume by volume, so that each volume is read in a single streaming pass:
+        void fill (ImageType image, int axis)
+        {
+          for (int v = 0; v < nvols; ++v) {
+            image.index (axis) = v;
+            value_type* p = &data[v];
+            for (int z = 0; z < dim[2]; ++z) {
+              image.index(2) = from[2] + z;
+              for (int y = 0; y < dim[1]; ++y) {
+                image.index(1) = from[1] + y;
+                for (int x = 0; x < dim[0]; ++x) {
+                  image.index(0) = from[0] + x;
+                  *p = image.value();
+                  p += nvols;
+                }
+              }
+              if (cancel)
+                return;
+            }
+          }
+          ready = true;
+          VT::wake_event_loop();
+        }
+    };
+
+
+
+
+
+
+    // Mean and standard deviation of the values within a cubic or spherical
+    // region of interest around the focus, for every volume along the plot
+    // axis. The sums are accumulated in parallel across volumes. When the ROI
+    // moves by a single voxel, they are updated incrementally by subtracting
+    // the voxels that have left the ROI and adding those that have entered it,
+    // rather than being recomputed from scratch.
+    class ROIStats
+    {
+      public:
+        using Offset = std::array<int,3>;
+
+        ROIStats (int radius, bool sphere) :
+          radius (radius),
+          sphere (sphere)
+        {
+          for (int z = -radius; z <= radius; ++z)
+            for (int y = -radius; y <= radius; ++y)
+              for (int x = -radius; x <= radius; ++x)
+                if (within ({ x, y, z }))
+                  offsets.push_back ({ x, y, z });
+
+          // voxels entering (relative to the new centre) and leaving (relative
+          // to the old centre) the ROI when moving by one voxel along +/- each axis:
+          for (int axis = 0; axis < 3; ++axis) {
+            for (int dir = 0; dir < 2; ++dir) {
+              const int step = dir ? -1 : 1;
+              for (const auto& o : offsets) {
+                Offset next (o), previous (o);
+                next[axis] += step;
+                previous[axis] -= step;
+                if (!within (next))
+                  entering[2*axis+dir].push_back (o);
+                if (!within (previous))
+                  leaving[2*axis+dir].push_back (o);
+              }
+            }
+          }
+        }
+
+        bool matches (int with_radius, bool with_sphere) const { return radius == with_radius && sphere == with_sphere; }
+        size_t size () const { return offsets.size(); }
+
+        void update (const ImageType& image, int axis, const vector<int>& position)
+        {
+          std::string image_key = image.name() + " " + str(axis);
+          for (size_t n = 3; n < image.ndim(); ++n)
+            if (int(n) != axis)
+              image_key += " " + str(image.index(n));
+
+          if (image_key == key) {
+            int moved = -1, distance = 0;
+            for (int n = 0; n < 3; ++n) {
+              if (position[n] != centre[n]) {
+                moved = n;
+                distance += std::abs (position[n] - centre[n]);
+              }
+            }
+            if (distance == 0)
+              return;
+            if (distance == 1) {
+              const int dir = 2*moved + (position[moved] < centre[moved] ? 1 : 0);
+              accumulate (image, axis, centre, leaving[dir], -1.0);
+              accumulate (image, axis, position, entering[dir], 1.0);
+              centre = position;
+              return;
+            }
+          }
+
+          key = image_key;
+          centre = position;
+          sum.assign (image.size (axis), 0.0);
+          sum_sq.assign (image.size (axis), 0.0);
+          count.assign (image.size (axis), 0);
+          accumulate (image, axis, centre, offsets, 1.0);
+        }
+
+        value_type mean (int v) const {
+          return count[v] ? sum[v] / count[v] : NaN;
+        }
+
+        value_type sd (int v) const {
+          if (count[v] < 2)
+            return count[v] ? 0.0 : NaN;
+          return std::sqrt (std::max (0.0, (sum_sq[v] - sum[v]*sum[v]/count[v]) / (count[v]-1)));
+        }
+
+        size_t bytes () const { return (sum.size() + sum_sq.size()) * sizeof(double) + count.size() * sizeof(ssize_t); }
+
+      private:
+        const int radius;
+        const bool sphere;
+        vector<Offset> offsets, entering[6], leaving[6];
+        std::string key;
+        vector<int> centre;
+        vector<double> sum, sum_sq;
+        vector<ssize_t> count;
+
+        bool within (const Offset& o) const {
+          if (sphere)
+            return o[0]*o[0] + o[1]*o[1] + o[2]*o[2] <= radius*radius;
+          return std::abs (o[0]) <= radius && std::abs (o[1]) <= radius && std::abs (o[2]) <= radius;
+        }
+
+        // add (sign = 1) or remove (sign = -1) the contributions of the voxels
+        // at 'position' + 'voxels', for each volume in parallel:
+        void accumulate (const ImageType& image, int axis, const vector<int>& position, const vector<Offset>& voxels, double sign)
+        {
+          double* S = &sum[0];
+          double* SS = &sum_sq[0];
+          ssize_t* N = &count[0];
+          ImageType in (image);
+          parallel_for (image.size (axis), [in,axis,&position,&voxels,sign,S,SS,N] (size_t v) mutable {
+              in.index (axis) = v;
+              double s = 0.0, ss = 0.0;
+              ssize_t n = 0;
+              for (const auto& o : voxels) {
+                bool inbounds = true;
+                for (int a = 0; a < 3; ++a) {
+                  in.index(a) = position[a] + o[a];
+                  if (in.index(a) < 0 || in.index(a) >= in.size(a))
+                    inbounds = false;
+                }
+                if (!inbounds)
+                  continue;
+                const double val = in.value();
+                if (std::isfinite (val)) {
+                  s += val;
+                  ss += val*val;
+                  ++n;
+                }
+              }
+              S[v] += sign * s;
+              SS[v] += sign * ss;
+              N[v] += sign > 0.0 ? n : -n;
+          });
+        }
+    };
+
+
+
+
+
+
+    // Intensity projections of the current volume along the slice axis, stored
+    // on the original image grid as single-slice scratch images, so that they
+    // can be resampled and rendered in exactly the same way as a regular slice.
+    // Projections are kept for each volume and orientation until evicted, and
+    // hold the raw intensities, so that changes to the colour scaling do not
+    // require them to be recomputed. When computed in the background, a single
+    // projection is computed at a time, and the event loop is woken up once it
+    // is ready.
+    class ProjectionCache
+    {
+      public:
+        ProjectionCache () : counter (0), ready (false), cancel (false) { }
+        ~ProjectionCache () { stop(); }
+
+        // set 'projection' and return true if the projection of the current
+        // volume of 'image' along 'axis' is available. Otherwise compute it,
+        // either immediately or in the background; in the latter case, return
+        // false until it is ready:
+        bool get (const ImageType& image, int axis, ProjectionMode mode, bool background, ImageType& projection)
+        {
+          if (thread.joinable() && ready) {
+            thread.join();
+            insert (pending_key, pending);
+          }
+
+          std::string key = image.name() + " " + str(axis) + " " + str(int(mode));
+          for (size_t n = 3; n < image.ndim(); ++n)
+            key += " " + str(image.index(n));
+
+          auto it = entries.find (key);
+          if (it != entries.end()) {
+            it->second.last_used = ++counter;
+            projection = it->second.image;
+            return true;
+          }
+
+          if (thread.joinable())
+            return false;
+
+          Header header (image);
+          header.ndim (3);
+          header.size (axis) = 1;
+          header.datatype() = DataType::Float32;
+          ImageType result = ImageType::scratch (header, "intensity projection");
+
+          if (!background) {
+            compute (image, result, axis, mode, cancel);
+            insert (key, result);
+            projection = result;
+            return true;
+          }
+
+          pending_key = key;
+          pending = result;
+          ready = cancel = false;
+          thread = std::thread ([this,image,result,axis,mode] {
+              compute (image, result, axis, mode, cancel);
+              ready = true;
+              VT::wake_event_loop();
+          });
+          return false;
+        }
+
+        size_t bytes () const {
+          size_t total = pending.valid() ? voxel_count (pending) * sizeof(value_type) : 0;
+          for (const auto& entry : entries)
+            total += voxel_count (entry.second.image) * sizeof(value_type);
+          return total;
+        }
+
+      private:
+        struct Entry {
+          ImageType image;
+          size_t last_used;
+        };
+        std::map<std::string,Entry> entries;
+        size_t counter;
+        std::string pending_key;
+        ImageType pending;
+        std::atomic<bool> ready, cancel;
+        std::thread thread;
+
+        void stop () {
+          cancel = true;
+          if (thread.joinable())
+            thread.join();
+        }
+
+        void insert (const std::string& key, const ImageType& image)
+        {
+          //CONF option: MRPeekProjectionCacheSize
+          //CONF default: 16
+          //CONF the maximum number of intensity projections (one per volume and
+          //CONF orientation) held in memory by mrpeek.
+          const size_t max_entries = std::max (1, File::Config::get_int ("MRPeekProjectionCacheSize", 16));
+          while (entries.size() >= max_entries) {
+            auto oldest = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+              if (it->second.last_used < oldest->second.last_used)
+                oldest = it;
+            entries.erase (oldest);
+          }
+          entries[key] = { image, ++counter };
+        }
+
+        // reduce along 'axis', with rows of the output processed in parallel.
+        // Within each row, slices are traversed in the outer loop, so that the
+        // input is read along rows rather than across slices:
+        static void compute (const ImageType& image, const ImageType& projection, int axis, ProjectionMode mode, const std::atomic<bool>& cancel)
+        {
+          const int x_axis = axis == 0 ? 1 : 0;
+          const int y_axis = axis == 2 ? 1 : 2;
+          ImageType in (image), out (projection);
+          parallel_for (image.size (y_axis), [in,out,axis,x_axis,y_axis,mode,&cancel] (size_t y) mutable {
+              if (cancel)
+                return;
+              const int nx = in.size (x_axis);
+              vector<double> acc (nx, mode == PROJECTION_MAX ? -std::numeric_limits<double>::infinity() :
+                  ( mode == PROJECTION_MIN ? std::numeric_limits<double>::infinity() : 0.0 ));
+              vector<size_t> count (nx, 0);
+              in.index (y_axis) = y;
+              for (in.index (axis) = 0; in.index (axis) < in.size (axis); ++in.index (axis)) {
+                for (int x = 0; x < nx; ++x) {
+                  in.index (x_axis) = x;
+                  const double val = in.value();
+                  if (!std::isfinite (val))
+                    continue;
+                  switch (mode) {
+                    case PROJECTION_MAX: acc[x] = std::max (acc[x], val); break;
+                    case PROJECTION_MIN: acc[x] = std::min (acc[x], val); break;
+                    default: acc[x] += val; break;
+                  }
+                  ++count[x];
+                }
+              }
+              out.index (axis) = 0;
+              out.index (y_axis) = y;
+              for (int x = 0; x < nx; ++x) {
+                out.index (x_axis) = x;
+                if (!count[x])
+                  out.value() = NaN;
+                else
+                  out.value() = mode == PROJECTION_MEAN ? acc[x] / count[x] : acc[x];
+              }
+          });
+        }
+    };
+
+
+
+
+
+
+    // Voxel-wise temporal statistics (mean, standard deviation, tSNR) across
+    // the volume axis, accumulated using Welford's algorithm in a single
+    // streaming pass through the volumes. Each volume is read in parallel
+    // across slices, then folded into the running statistics while holding
+    // the lock, so that a consistent map of the statistics over the volumes
+    // processed so far can be produced at any time. When run in the
+    // background, the event loop is woken up periodically as the pass
+    // progresses, so that the display can be updated.
+    class TemporalStats
+    {
+      public:
+        TemporalStats () : nvols (0), nprocessed (0), cancel (false) { }
+        ~TemporalStats () { stop(); }
+
+        // return a map of 'stat' over the volumes of 'image' along 'axis'
+        // processed so far, starting a new pass if required:
+        ImageType get (const ImageType& image, int axis, TemporalStat stat, bool background)
+        {
+          std::string image_key = image.name() + " " + str(axis);
+          for (size_t n = 3; n < image.ndim(); ++n)
+            if (int(n) != axis)
+              image_key += " " + str(image.index(n));
+
+          if (image_key != key) {
+            stop();
+            key = image_key;
+            nvols = image.size (axis);
+            nprocessed = 0;
+            const size_t nvox = voxel_count (image, 0, 3);
+            mean.assign (nvox, 0.0);
+            m2.assign (nvox, 0.0);
+            count.assign (nvox, 0);
+            map = ImageType();
+            cancel = false;
+            if (background) {
+              thread = std::thread (&TemporalStats::run_pass, this, image, axis, true);
+              // wait for enough volumes to produce a meaningful map:
+              std::unique_lock<std::mutex> lock (mutex);
+              condition.wait (lock, [&] { return nprocessed >= std::min (2, nvols); });
+            }
+            else
+              run_pass (image, axis, false);
+          }
+
+          std::lock_guard<std::mutex> lock (mutex);
+          if (!map.valid() || map_stat != stat || map_count != nprocessed)
+            derive (image, stat);
+          return map;
+        }
+
+        int processed () const { return nprocessed; }
+        int size () const { return nvols; }
+
+        size_t bytes () {
+          std::lock_guard<std::mutex> lock (mutex);
+          return (mean.size() + m2.size()) * sizeof(double) + count.size() * sizeof(uint32_t)
+            + ( map.valid() ? voxel_count (map) * sizeof(value_type) : 0 );
+        }
+
+      private:
+        std::string key;
+        int nvols;
+        std::atomic<int> nprocessed;
+        std::atomic<bool> cancel;
+        vector<double> mean, m2;
+        vector<uint32_t> count;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::thread thread;
+        ImageType map;
+        TemporalStat map_stat;
+        int map_count;
+
+        void stop () {
+          cancel = true;
+          if (thread.joinable())
+            thread.join();
+        }
+
+        void run_pass (ImageType image, int axis, bool background)
+        {
+          const size_t slice_size = image.size(0) * image.size(1);
+          vector<value_type> buffer (voxel_count (image, 0, 3));
+          value_type* data = &buffer[0];
+          double* M = &mean[0];
+          double* M2 = &m2[0];
+          uint32_t* N = &count[0];
+          Timer timer;
+
+          for (int v = 0; v < nvols; ++v) {
+            if (cancel)
+              return;
+            image.index (axis) = v;
+            parallel_for (image.size(2), [image,data,slice_size] (size_t z) mutable {
+                image.index(2) = z;
+                value_type* p = data + z*slice_size;
+                for (image.index(1) = 0; image.index(1) < image.size(1); ++image.index(1))
+                  for (image.index(0) = 0; image.index(0) < image.size(0); ++image.index(0))
+                    *p++ = image.value();
+            });
+
+            {
+              std::lock_guard<std::mutex> lock (mutex);
+              parallel_for (image.size(2), [data,M,M2,N,slice_size] (size_t z) {
+                  for (size_t i = z*slice_size; i < (z+1)*slice_size; ++i) {
+                    const double val = data[i];
+                    if (!std::isfinite (val))
+                      continue;
+                    const double delta = val - M[i];
+                    M[i] += delta / ++N[i];
+                    M2[i] += delta * (val - M[i]);
+                  }
+              });
+              ++nprocessed;
+            }
+            condition.notify_all();
+
+            if (background && (nprocessed == nvols || timer.elapsed() > 0.1)) {
+              VT::wake_event_loop();
+              timer.start();
+            }
+          }
+        }
+
+        // produce a new map of 'stat', so that any held elsewhere remain valid.
+        // The map is named after the number of volumes included, to invalidate
+        // anything cached for previous maps:
+        void derive (const ImageType& image, TemporalStat stat)
+        {
+          Header header (image);
+          header.ndim (3);
+          header.datatype() = DataType::Float32;
+          map = ImageType::scratch (header, image.name() + " [temporal "
+              + temporal_stat_choices[stat] + " over " + str(int(nprocessed)) + " volumes]");
+          map_stat = stat;
+          map_count = nprocessed;
+
+          const size_t slice_size = image.size(0) * image.size(1);
+          const double* M = &mean[0];
+          const double* M2 = &m2[0];
+          const uint32_t* N = &count[0];
+          ImageType out (map);
+          parallel_for (out.size(2), [out,stat,M,M2,N,slice_size] (size_t z) mutable {
+              out.index(2) = z;
+              size_t i = z*slice_size;
+              for (out.index(1) = 0; out.index(1) < out.size(1); ++out.index(1)) {
+                for (out.index(0) = 0; out.index(0) < out.size(0); ++out.index(0), ++i) {
+                  const double sd = N[i] > 1 ? std::sqrt (M2[i] / (N[i]-1)) : NaN;
+                  switch (stat) {
+                    case TEMPORAL_MEAN: out.value() = N[i] ? M[i] : NaN; break;
+                    case TEMPORAL_STD: out.value() = sd; break;
+                    default: out.value() = sd > 0.0 ? M[i] / sd : NaN; break;
+                  }
+                }
+              }
+          });
+        }
+    };
+
+
+
+
+
+
+    inline std::string View::move_down (int n) const {
+      if (interactive)
+        return move_cursor (Down, n);
+      std::string out;
+      for (int i = 0; i < n; ++i)
+        out += "\n";
+      return out;
+    }
+
+
+    // calculate percentile of a list of numbers
+    // implementation based on `mrthreshold` - can be merged with Math::median in due course
+    template <class Container>
+    value_type percentile (Container& data, default_type percentile)
+    {
+      // ignore nan
+      auto isnotfinite = [](typename Container::value_type val) { return !std::isfinite(val); };
+      data.erase (std::remove_if (data.begin(), data.end(), isnotfinite), data.end());
+      if (percentile == 100.0) {
+        return default_type(*std::max_element (data.begin(), data.end()));
+      } else if (percentile == 0.0) {
+        return default_type(*std::min_element (data.begin(), data.end()));
+      } else {
+        const default_type interp_index = 0.01 * percentile * (data.size()-1);
+        const size_t lower_index = size_t(std::floor (interp_index));
+        const default_type mu = interp_index - default_type(lower_index);
+        std::nth_element (data.begin(), data.begin() + lower_index, data.end());
+        const default_type lower_value = default_type(data[lower_index]);
+        std::nth_element (data.begin(), data.begin() + lower_index + 1, data.end());
+        const default_type upper_value = default_type(data[lower_index + 1]);
+        return (1.0-mu)*lower_value + mu*upper_value;
+      }
+    }
+
+
+
+
+
+    // Supporting functions for display
+    //
+    // the overlay colourmap (if any) uses the same number of levels, and
+    // follows on from the main colourmap's index range:
+    void View::set_levels (int n)
+    {
+      const int max_levels = colourmaps.size() > 2 ? MAX_OVERLAY_LEVELS : MAX_LEVELS;
+      if (n < 1 || n > max_levels)
+        throw Exception ("number of colourmap levels must be between 1 and " + str(max_levels));
+      levels = n;
+      colourmaps[1].set_levels (levels);
+      if (colourmaps.size() > 2) {
+        colourmaps[2].index = colourmaps[1].last_index() + 1;
+        colourmaps[2].set_levels (levels);
+      }
+    }
+
+
+
+    // overlay intensities are mapped from the threshold up to the maximum:
+    void View::set_overlay (ImageType& image, value_type threshold, int colourmap_ID)
+    {
+      if (levels > MAX_OVERLAY_LEVELS)
+        throw Exception ("number of colourmap levels cannot exceed " + str(MAX_OVERLAY_LEVELS) + " when displaying an overlay");
+      overlay = image;
+      overlay_threshold = threshold;
+
+      value_type vmax = threshold;
+      for (auto l = Loop (0, 3) (image); l; ++l)
+        if (std::isfinite (image.value()))
+          vmax = std::max<value_type> (vmax, image.value());
+      if (vmax <= threshold)
+        vmax = threshold + 1.0;
+
+      colourmaps.add (colourmap_ID, levels);
+      colourmaps[2].set_scaling_min_max (threshold, vmax);
+      for (auto& keys : overlay_keys)
+        keys.clear();
+    }
+
+
+
+
+    void View::cache_timeseries ()
+    {
+      timeseries = std::make_shared<TimeSeriesCache>();
+    }
+
+
+
+    size_t View::cache_bytes () const
+    {
+      return ( timeseries ? timeseries->bytes() : 0 )
+        + ( roi_stats ? roi_stats->bytes() : 0 )
+        + ( projections ? projections->bytes() : 0 )
+        + ( temporal_stats ? temporal_stats->bytes() : 0 );
+    }
+
+
+
+    void View::clear_caches ()
+    {
+      projections = nullptr;
+      temporal_stats = nullptr;
+      roi_stats = nullptr;
+      if (timeseries)
+        cache_timeseries();
+    }
+
+
+
+    // The focus is preserved in scanner space, and the zoom in terms of the
+    // pixel size in mm. The current volume is kept where the new image has it:
+    void View::switch_image (const ImageType& from, ImageType& to)
+    {
+      const Eigen::Vector3d position = Transform (from).voxel2scanner * Eigen::Vector3d (focus[0], focus[1], focus[2]);
+      const Eigen::Vector3d voxel = Transform (to).scanner2voxel * position;
+      for (int n = 0; n < 3; ++n)
+        focus[n] = std::min (std::max (int (std::round (voxel[n])), 0), int (to.size(n)) - 1);
+      for (size_t n = 3; n < to.ndim(); ++n)
+        to.index(n) = n < from.ndim() ? std::min (from.index(n), to.size(n)-1) : 0;
+
+      if (vol_axis >= int(to.ndim()) || (vol_axis < 0 && to.ndim() > 3))
+        vol_axis = to.ndim() > 3 ? 3 : -1;
+      if (plot_axis >= int(to.ndim()))
+        plot_axis = 2;
+
+      zoom *= std::min (std::min (from.spacing(0), from.spacing(1)), from.spacing(2))
+        / std::min (std::min (to.spacing(0), to.spacing(1)), to.spacing(2));
+
+      // cached slices are only valid for the geometry of the previous image:
+      for (int n = 0; n < 3; ++n)
+        overlay_keys[n].clear();
+      thumbnails_key.clear();
+    }
+
+
+
+    // The data shown are the slices through the focus (or every lightbox'th
+    // slice) in the current volume, or in all volumes where required. Where the
+    // whole volume contributes (projections, oblique slices), every slice along
+    // the slice axis is included. Each slice is hashed separately, in parallel:
+    uint64_t View::checksum (ImageType& image) const
+    {
+      vector<std::pair<int,int>> planes;  // axis & index of each slice
+      if (projection != PROJECTION_NONE || oblique() || lightbox) {
+        const int step = lightbox && !oblique() && projection == PROJECTION_NONE ? lightbox : 1;
+        for (int n = step > 1 ? focus[slice_axis] % step : 0; n < image.size (slice_axis); n += step)
+          planes.push_back ({ slice_axis, n });
+      }
+      else {
+        for (int axis = 0; axis < 3; ++axis)
+          if (orthoview || axis == slice_axis)
+            planes.push_back ({ axis, focus[axis] });
+      }
+      if (do_plot && plot_axis < 3)
+        planes.push_back ({ (plot_axis+1) % 3, focus[(plot_axis+1) % 3] });
+
+      vector<int> volumes (1, vol_axis >= 0 ? image.index (vol_axis) : 0);
+      if (vol_axis >= 0 && (temporal != TEMPORAL_NONE || volume_grid || (do_plot && plot_axis == vol_axis))) {
+        volumes.resize (image.size (vol_axis));
+        for (size_t n = 0; n < volumes.size(); ++n)
+          volumes[n] = n;
+      }
+
+      vector<uint64_t> hashes (planes.size() * volumes.size());
+      parallel_for (hashes.size(), [&planes,&volumes,&hashes,image,this] (size_t n) mutable {
+          const int axis = planes[n % planes.size()].first;
+          const int a0 = axis == 0 ? 1 : 0, a1 = axis == 2 ? 1 : 2;
+          image.index (axis) = planes[n % planes.size()].second;
+          if (vol_axis >= 0)
+            image.index (vol_axis) = volumes[n / planes.size()];
+          // FNV-1a over the bit patterns of the values:
+          uint64_t hash = 14695981039346656037ULL;
+          for (image.index(a1) = 0; image.index(a1) < image.size(a1); ++image.index(a1)) {
+            for (image.index(a0) = 0; image.index(a0) < image.size(a0); ++image.index(a0)) {
+              const value_type val = image.value();
+              const uint8_t* bytes = reinterpret_cast<const uint8_t*> (&val);
+              for (size_t b = 0; b < sizeof (val); ++b)
+                hash = (hash ^ bytes[b]) * 1099511628211ULL;
+            }
+          }
+          hashes[n] = hash;
+      });
+
+      uint64_t hash = 14695981039346656037ULL;
+      for (auto h : hashes)
+        hash = (hash ^ h) * 1099511628211ULL;
+      return hash;
+    }
+
+
+
+    std::string View::state_key (const ImageType& image) const
+    {
+      std::string key = image.name();
+      for (size_t n = 3; n < image.ndim(); ++n)
+        key += " " + str(image.index(n));
+      for (int n = 0; n < 3; ++n)
+        key += " " + str(focus[n]);
+      key += " " + str(levels) + " " + str(slice_axis) + " " + str(plot_axis) + " " + str(vol_axis)
+        + " " + str(pmin) + " " + str(pmax) + " " + str(zoom)
+        + " " + str(int(crosshair)) + str(int(colorbar)) + str(int(orthoview)) + str(int(interactive))
+        + str(int(do_plot)) + str(int(show_image)) + str(int(interpolate)) + str(int(show_text))
+        + " " + str(lightbox) + " " + str(volume_grid) + " " + str(int(projection)) + " " + str(int(temporal))
+        + " " + str(tilt[0]) + " " + str(tilt[1]) + " " + str(max_width) + " " + str(max_height)
+        + " " + str(int(x_arrow_mode)) + " " + str(int(arrow_mode))
+        + " " + str(colourmaps[1].ID) + " " + str(int(colourmaps[1].scaling_set()))
+        + " " + str(colourmaps[1].offset(), 10) + " " + str(colourmaps[1].scale(), 10)
+        + " " + str(plot_roi) + " " + str(int(plot_roi_sphere)) + " " + str(int(rgb)) + " " + str(int(labels_mode))
+        + " " + str(overlay_threshold) + " " + caption;
+      return key;
+    }
+
+
+
+    void View::set_axes ()
+    {
+      switch (slice_axis) {
+        case 0: x_axis = 1; y_axis = 2; break;
+        case 1: x_axis = 0; y_axis = 2; break;
+        case 2: x_axis = 0; y_axis = 1; break;
+        default: throw Exception ("invalid axis specifier");
+      }
+    }
+
+
+
+
+    std::string View::show_focus (ImageType& image)
+    {
+      image.index(0) = focus[0];
+      image.index(1) = focus[1];
+      image.index(2) = focus[2];
+      std::string out = ClearLine;
+      out += "index: [ ";
+
+      for (int d = 0; d < 3; d++) {
+        if (d == x_axis) {
+          if (arrow_mode == ARROW_CROSSHAIR)
+            out += std::string(LeftRightArrow) + TextForegroundYellow;
+          out += TextUnderscore;
+        }
+        else if (d == y_axis) {
+          if (arrow_mode == ARROW_CROSSHAIR)
+            out += std::string(UpDownArrow) + TextForegroundYellow;
+          out += TextUnderscore;
+        }
+        else {
+          if (arrow_mode == ARROW_SLICEVOL)
+            out += std::string(LeftRightArrow) + TextForegroundYellow;
+        }
+        out += str(focus[d]) + TextReset + " ";
+      }
+      for (int n = 3; n < int(image.ndim()); ++n) {
+        if (n == vol_axis && arrow_mode == ARROW_SLICEVOL)
+          out += std::string(UpDownArrow) + TextForegroundYellow;
+        out += str(image.index(n)) + TextReset + " ";
+      }
+      out += "] ";
+
+      out += "| value: " + str(image.value());
+
+      return out;
+    }
+
+
+
+
+    // regrid to the zoomed voxel size. If 'crop' is set, the region rendered
+    // is limited to 'extent' pixels along each axis, centred on the focus where
+    // possible, and its offset recorded in 'pan':
+    inline Reslicer View::get_regridder (ImageType& image, int with_slice_axis, bool crop)
+    {
+      Profile::Timer timer (profiler.get(), Profile::REGRID);
+      Header header_target (image);
+      default_type original_extent;
+      for (int d = 0; d < 3; ++d) {
+        const float new_voxel_size = (d == with_slice_axis) ? image.spacing(d) : 1.0f/zoom;
+
+        original_extent = image.size(d) * image.spacing(d);
+
+        header_target.size(d) = std::round (image.size(d) * image.spacing(d) / new_voxel_size - 0.0001); // round down at .5
+        for (size_t i = 0; i < 3; ++i)
+          header_target.transform()(i,3) += 0.5 * (
+              (new_voxel_size - header_target.spacing(d)) +
+              (original_extent - (header_target.size(d) * new_voxel_size))
+              ) * header_target.transform()(i,d);
+        header_target.spacing(d) = new_voxel_size;
+
+        if (d == with_slice_axis)
+          continue;
+        pan[d] = 0;
+        if (crop && extent[d] > 0 && header_target.size(d) > extent[d]) {
+          const int centre = std::floor (image.spacing(d) * (focus[d] + 0.5) / new_voxel_size);
+          pan[d] = std::min (std::max (centre - extent[d]/2, 0), int(header_target.size(d)) - extent[d]);
+          header_target.size(d) = extent[d];
+          for (size_t i = 0; i < 3; ++i)
+            header_target.transform()(i,3) += pan[d] * new_voxel_size * header_target.transform()(i,d);
+        }
+      }
+
+      return { image, header_target };
+    }
+
+
+
+
+
+    // the image to render for the given slice axis, returning the slice to
+    // render within it: the intensity projection along that axis if enabled and
+    // available, otherwise the image itself at the focus:
+    int View::get_source (ImageType& image, int axis, ImageType& source)
+    {
+      source = image;
+      if (projection == PROJECTION_NONE)
+        return focus[axis];
+      if (!projections)
+        projections = std::make_shared<ProjectionCache>();
+      if (projections->get (image, axis, projection, interactive && background, source))
+        return 0;
+      projection_pending = true;
+      return focus[axis];
+    }
+
+
+
+    // the percentiles are computed over the voxels of the slice at its native
+    // resolution rather than as resampled for display, so that the cost does
+    // not grow with the zoom:
+    void View::autoscale (ImageType& image, Sixel::CMap& cmap)
+    {
+      Profile::Timer timer (profiler.get(), Profile::AUTOSCALE);
+      ImageType source;
+      const int slice = get_source (image, slice_axis, source);
+      rescale_pending = projection_pending || temporal_pending;
+      source.index(slice_axis) = slice;
+
+      vector<value_type> currentslice;
+      currentslice.reserve (size_t (source.size(x_axis)) * source.size(y_axis));
+      for (auto l = Loop (vector<size_t>({ size_t(x_axis), size_t(y_axis) }))(source); l; ++l)
+        currentslice.push_back (source.value());
+
+      value_type vmin = percentile(currentslice, pmin);
+      value_type vmax = percentile(currentslice, pmax);
+      cmap.set_scaling_min_max (vmin, vmax);
+      INFO("reset intensity range to " + str(vmin) + " - " +str(vmax));
+    }
+
+
+
+
+
+
+    // add crosshairs at the specified position,
+    // using colour index specified:
+    void draw_frame (const Sixel::ViewPort& view, int index)
+    {
+      for (int x = 0; x < view.xdim(); ++x)
+        view(x,0) = view(x,view.ydim()-1) = index;
+      for (int y = 0; y < view.ydim(); ++y)
+        view(0,y) = view(view.xdim()-1,y) = index;
+    }
+
+
+
+
+
+
+    // add crosshairs at the specified position,
+    // using colour index specified:
+    void draw_crosshairs (const Sixel::ViewPort& view, int x0, int y0, int index) {
+      for (int x = 0; x < view.xdim(); ++x)
+        view(x,y0) = index;
+      for (int y = 0; y < view.ydim(); ++y)
+        view(x0,y) = index;
+    }
+
+
+
+
+    // invoke functor(y) for each row of a slice of x_dim by y_dim pixels. For
+    // slices large enough to make it worthwhile, blocks of rows are handed out
+    // to the threads as they become available. Each thread operates on its own
+    // copy of the functor, which can therefore hold its own interpolator:
+    template <class Functor>
+    void for_each_row (int x_dim, int y_dim, Functor functor)
+    {
+      constexpr int rows_per_block = 8;
+      constexpr size_t min_parallel_pixels = 65536;
+      const size_t nblocks = (y_dim + rows_per_block - 1) / rows_per_block;
+      const size_t nthreads = size_t(x_dim) * y_dim < min_parallel_pixels ? 1 : Thread::number_of_threads();
+      parallel_for (nblocks, [functor,y_dim] (size_t block) mutable {
+          const int y_end = std::min (int(block+1) * rows_per_block, y_dim);
+          for (int y = block * rows_per_block; y < y_end; ++y)
+            functor (y);
+      }, nthreads);
+    }
+
+
+
+    // overlay pixels above threshold take precedence over the image, which is
+    // then not sampled at all, so the two are composited in a single pass:
+    template <class InterpType>
+    void View::render_slice (const Axes& axes, InterpType& regrid, const Sixel::ViewPort& view, const Sixel::CMap& cmap, int slice, const value_type* overlay) const
+    {
+      const int x_dim = regrid.size(axes.x);
+      const int y_dim = regrid.size(axes.y);
+
+      regrid.index(axes.slice) = slice;
+      for_each_row (x_dim, y_dim, [this,&axes,&view,&cmap,regrid,overlay,x_dim,y_dim] (int y) mutable {
+          regrid.index(axes.y) = y_dim-1-y;
+          const value_type* row_overlay = overlay ? overlay + size_t(y)*x_dim : nullptr;
+          for (int x = 0; x < x_dim; ++x) {
+            if (row_overlay && row_overlay[x] > overlay_threshold) {
+              view(x,y) = overlay_cmap() (row_overlay[x]);
+              continue;
+            }
+            regrid.index(axes.x) = x_dim-1-x;
+            view(x,y) = show_rgb ? rgb_colour (regrid, cmap, x, y) : cmap (regrid.value());
+          }
+      });
+    }
+
+
+
+    void View::display_slice (const Axes& axes, const ImageType& image, Reslicer& regrid, const Sixel::ViewPort& view, const Sixel::CMap& cmap, int slice, const value_type* overlay) const
+    {
+      Profile::Timer timer (profiler.get(), Profile::RENDER);
+      if (show_labels)
+        display_labels (axes, image, regrid, view, slice, false, overlay);
+      else if (interpolate) {
+        LinearReslicer reslicer (image, regrid);
+        render_slice (axes, reslicer, view, cmap, slice, overlay);
+      }
+      else
+        render_slice (axes, regrid, view, cmap, slice, overlay);
+    }
+
+
+
+    // invoke functor(interp,x,y) with a copy of 'interp' positioned at each
+    // pixel of the slice of the regridded image, tilted about 'centre' if
+    // requested. Rather than mapping each pixel through the full
+    // target-to-source transform, the source voxel position is computed once
+    // at the start of each row, and stepped incrementally along the row from
+    // there. Rows may be processed concurrently, each thread with its own
+    // copy of 'interp':
+    template <class InterpType, class Functor>
+    void View::sample_plane (const Axes& axes, InterpType& interp, const Reslicer& regrid, const Eigen::Vector3d& centre, bool tilted, int slice, Functor&& functor) const
+    {
+      const int x_dim = regrid.size(axes.x);
+      const int y_dim = regrid.size(axes.y);
+
+      const Transform source (interp), target (regrid);
+      transform_type rotation;
+      rotation.setIdentity();
+      if (tilted)
+        rotation.translate (centre)
+          .rotate (Eigen::AngleAxisd (tilt[1], target.image2scanner.linear().col (axes.y).normalized()))
+          .rotate (Eigen::AngleAxisd (tilt[0], target.image2scanner.linear().col (axes.x).normalized()))
+          .translate (-centre);
+      const transform_type target2source = source.scanner2voxel * rotation * target.voxel2scanner;
+      const Eigen::Vector3d step = -target2source.linear().col (axes.x);
+
+      for_each_row (x_dim, y_dim, [&,interp] (int y) mutable {
+          Eigen::Vector3d index;
+          index[axes.slice] = slice;
+          index[axes.x] = x_dim-1;
+          index[axes.y] = y_dim-1-y;
+          Eigen::Vector3d pos = target2source * index;
+          for (int x = 0; x < x_dim; ++x, pos += step) {
+            interp.voxel (pos);
+            functor (interp, x, y);
+          }
+      });
+    }
+
+
+
+    // position of the focus in scanner coordinates:
+    inline Eigen::Vector3d View::focus_position (const ImageType& image) const
+    {
+      return Transform (image).voxel2scanner * Eigen::Vector3d (focus[0], focus[1], focus[2]);
+    }
+
+
+
+    // Build the fixed palette for true colour or label display, using as many
+    // colours as fit within the 256 sixel colour registers along with the
+    // overlay colourmap. The palette only depends on the display mode and the
+    // number of levels, so is kept until either changes:
+    void View::set_fixed_palette ()
+    {
+      const std::string key = str(int(show_labels)) + " " + str(levels) + " " + str(int(overlay.valid()));
+      if (key == fixed_palette_key)
+        return;
+      fixed_palette_key = key;
+
+      std::vector<std::array<int,3>> colours STATIC_CMAP;
+      fixed_first = colours.size();
+      const int available = 256 - (colours.size() + 2 + (overlay.valid() ? levels + 1 : 0));
+
+      if (show_labels) {
+        // spread hues using the golden ratio, so that consecutive entries (and
+        // hence labels hashed to them) are as distinct as possible, cycling
+        // through a few saturation & brightness combinations:
+        num_label_colours = std::min (available, 200);
+        for (int n = 0; n < num_label_colours; ++n) {
+          const float h = 6.0f * std::fmod (n * 0.618034f, 1.0f);
+          const float sat = n % 3 == 2 ? 0.5f : 1.0f, val = n % 2 ? 0.7f : 1.0f;
+          const float f = h - std::floor (h);
+          const float p = val * (1.0f-sat), q = val * (1.0f-sat*f), t = val * (1.0f-sat*(1.0f-f));
+          float rgb[3];
+          switch (int(h) % 6) {
+            case 0: rgb[0] = val; rgb[1] = t; rgb[2] = p; break;
+            case 1: rgb[0] = q; rgb[1] = val; rgb[2] = p; break;
+            case 2: rgb[0] = p; rgb[1] = val; rgb[2] = t; break;
+            case 3: rgb[0] = p; rgb[1] = q; rgb[2] = val; break;
+            case 4: rgb[0] = t; rgb[1] = p; rgb[2] = val; break;
+            default: rgb[0] = val; rgb[1] = p; rgb[2] = q; break;
+          }
+          colours.push_back ({ int(std::round (100.0f*rgb[0])), int(std::round (100.0f*rgb[1])), int(std::round (100.0f*rgb[2])) });
+        }
+      }
+      else {
+        rgb_levels = 6;
+        while (rgb_levels > 2 && rgb_levels*rgb_levels*rgb_levels > available)
+          --rgb_levels;
+        for (int r = 0; r < rgb_levels; ++r)
+          for (int g = 0; g < rgb_levels; ++g)
+            for (int b = 0; b < rgb_levels; ++b)
+              colours.push_back ({ 100*r/(rgb_levels-1), 100*g/(rgb_levels-1), 100*b/(rgb_levels-1) });
+      }
+
+      fixed_colourmaps = Sixel::ColourMaps();
+      fixed_colourmaps.add (colours);
+      if (overlay.valid()) {
+        fixed_colourmaps.add (colourmaps[2].ID, levels);
+        fixed_colourmaps[1].set_scaling (colourmaps[2].offset(), colourmaps[2].scale());
+      }
+
+      //CONF option: MRPeekRGBDither
+      //CONF default: 1 (true)
+      //CONF whether to apply ordered dithering when quantising colour images
+      //CONF to the sixel palette.
+      rgb_dither = File::Config::get_bool ("MRPeekRGBDither", true);
+    }
+
+
+
+    // palette index for the colour at the current position of 'in', taken
+    // from the first three volumes along the volume axis. Each channel is
+    // scaled using the main colourmap's scaling and quantised to the colour
+    // cube, using a 4x4 ordered (Bayer) dither to preserve smooth gradients:
+    template <class ImageType>
+    inline uint8_t View::rgb_colour (ImageType& in, const Sixel::CMap& cmap, int x, int y) const
+    {
+      static const float bayer[4][4] = {
+        {  0.5f/16,  8.5f/16,  2.5f/16, 10.5f/16 },
+        { 12.5f/16,  4.5f/16, 14.5f/16,  6.5f/16 },
+        {  3.5f/16, 11.5f/16,  1.5f/16,  9.5f/16 },
+        { 15.5f/16,  7.5f/16, 13.5f/16,  5.5f/16 }
+      };
+      const float threshold = rgb_dither ? bayer[y&3][x&3] : 0.5f;
+      const float offset = cmap.offset(), scale = cmap.scale();
+      const ssize_t volume = in.index (vol_axis);
+      int index = 0;
+      for (int c = 0; c < 3; ++c) {
+        in.index (vol_axis) = c;
+        float val = (rgb_levels-1) * (offset + scale * in.value());
+        int level = std::isfinite (val) ? std::floor (val) : 0;
+        if (val - level > threshold)
+          ++level;
+        index = rgb_levels*index + std::min (std::max (level, 0), rgb_levels-1);
+      }
+      in.index (vol_axis) = volume;
+      return fixed_first + index;
+    }
+
+
+
+    // palette index for a label. Colours are assigned by hashing the label
+    // value onto the palette, so that they remain stable regardless of which
+    // labels are visible, without storing a lookup table entry for every label.
+    // Label 0 is background:
+    inline uint8_t View::label_colour (int32_t label) const
+    {
+      if (!label)
+        return 0;
+      uint32_t hash = uint32_t (label) * 2654435761U;
+      hash ^= hash >> 16;
+      return fixed_first + hash % num_label_colours;
+    }
+
+
+
+    // render the label slice using nearest-neighbour sampling. In outline mode,
+    // only pixels whose label differs from that of any of their 4 neighbours
+    // are coloured, determined in a single pass over the resampled labels:
+    void View::display_labels (const Axes& axes, const ImageType& image, const Reslicer& regrid, const Sixel::ViewPort& view, int slice, bool tilted, const value_type* overlay) const
+    {
+      const int x_dim = regrid.size(axes.x);
+      const int y_dim = regrid.size(axes.y);
+      vector<int32_t> labels (size_t(x_dim) * y_dim);
+      Interp::Nearest<ImageType> interp (image, 0.0);
+      sample_plane (axes, interp, regrid, focus_position (image), tilted, slice,
+          [&](Interp::Nearest<ImageType>& interp, int x, int y) {
+            const value_type val = interp.value();
+            labels[size_t(y)*x_dim + x] = std::isfinite (val) ? std::lround (val) : 0;
+      });
+
+      for_each_row (x_dim, y_dim, [&] (int y) {
+          const int32_t* l = &labels[size_t(y)*x_dim];
+          const value_type* row_overlay = overlay ? overlay + size_t(y)*x_dim : nullptr;
+          for (int x = 0; x < x_dim; ++x, ++l) {
+            if (row_overlay && row_overlay[x] > overlay_threshold) {
+              view(x,y) = overlay_cmap() (row_overlay[x]);
+              continue;
+            }
+            bool show = true;
+            if (labels_mode == LABELS_OUTLINE)
+              show = (x > 0 && l[-1] != l[0]) || (x < x_dim-1 && l[1] != l[0]) ||
+                (y > 0 && l[-x_dim] != l[0]) || (y < y_dim-1 && l[x_dim] != l[0]);
+            view(x,y) = show ? label_colour (*l) : 0;
+          }
+      });
+    }
+
+
+
+    // render the slice of the regridded image tilted about the focus,
+    // compositing the overlay (if any) in the same pass:
+    template <class InterpType>
+    void View::render_oblique (const Axes& axes, InterpType& interp, const Reslicer& regrid, const Eigen::Vector3d& centre,
+        const Sixel::ViewPort& view, const Sixel::CMap& cmap, int slice, const value_type* overlay) const
+    {
+      const int x_dim = regrid.size(axes.x);
+      sample_plane (axes, interp, regrid, centre, true, slice, [&](InterpType& interp, int x, int y) {
+          if (overlay && overlay[size_t(y)*x_dim + x] > overlay_threshold)
+            view(x,y) = overlay_cmap() (overlay[size_t(y)*x_dim + x]);
+          else
+            view(x,y) = show_rgb ? rgb_colour (interp, cmap, x, y) : cmap (interp.value());
+      });
+    }
+
+
+
+    void View::display_oblique (const Axes& axes, const ImageType& image, const Reslicer& regrid, const Sixel::ViewPort& view, const Sixel::CMap& cmap, int slice, const value_type* overlay) const
+    {
+      Profile::Timer timer (profiler.get(), Profile::RENDER);
+      if (show_labels)
+        display_labels (axes, image, regrid, view, slice, true, overlay);
+      else if (interpolate) {
+        Interp::Linear<ImageType> interp (image, 0.0);
+        render_oblique (axes, interp, regrid, focus_position (image), view, cmap, slice, overlay);
+      }
+      else {
+        Interp::Nearest<ImageType> interp (image, 0.0);
+        render_oblique (axes, interp, regrid, focus_position (image), view, cmap, slice, overlay);
+      }
+    }
+
+
+
+    // the overlay resampled onto the pixels of the current slice of 'regrid',
+    // or nullptr if there is no overlay. Each orientation keeps its own copy,
+    // which is only resampled when the geometry of the slice changes - not when
+    // the image itself, its volume or its intensity scaling do:
+    const value_type* View::get_overlay (const Axes& axes, const ImageType& image, const Reslicer& regrid, bool tilted)
+    {
+      if (!overlay.valid())
+        return nullptr;
+
+      const int x_dim = regrid.size(axes.x);
+      const int y_dim = regrid.size(axes.y);
+      std::string key = str(focus[axes.slice]) + " " + str(x_dim) + " " + str(y_dim) + " "
+        + str(pan[axes.x]) + " " + str(pan[axes.y]) + " " + str(zoom);
+      if (tilted)
+        key += " " + str(tilt[0]) + " " + str(tilt[1]) + " " + str(focus[axes.x]) + " " + str(focus[axes.y]);
+
+      auto& data = overlay_slices[axes.slice];
+      if (key != overlay_keys[axes.slice]) {
+        Profile::Timer timer (profiler.get(), Profile::REGRID);
+        data.resize (size_t(x_dim) * y_dim);
+        Interp::Nearest<ImageType> interp (overlay, NaN);
+        sample_plane (axes, interp, regrid, focus_position (image), tilted, focus[axes.slice],
+            [&](Interp::Nearest<ImageType>& interp, int x, int y) {
+              data[size_t(y)*x_dim + x] = interp.value();
+        });
+        overlay_keys[axes.slice] = key;
+      }
+      return &data[0];
+    }
+
+
+
+    // draw crosshairs at the focus, for a panel of the given size,
+    // offset vertically by dy within the viewport:
+    void View::draw_focus (const Axes& axes, const Sixel::ViewPort& view, const ImageType& image, int x_dim, int y_dim, int dy) const
+    {
+      int x = std::round(x_dim + pan[axes.x] - image.spacing(axes.x) * (focus[axes.x] + 0.5) * zoom);
+      int y = std::round(y_dim + pan[axes.y] - image.spacing(axes.y) * (focus[axes.y] + 0.5) * zoom);
+      x = std::max (std::min (x, x_dim-1), 0);
+      y = std::max (std::min (y, y_dim-1), 0);
+      draw_crosshairs (view, x, y+dy, CROSSHAIR_COLOUR);
+    }
+
+
+
+    void draw_colourbar (const Sixel::ViewPort& view, const Sixel::CMap& cmap)
+    {
+      for (int y = 0; y < view.ydim(); ++y) {
+        int colour = cmap.index + std::round (cmap.levels() * (1.0f-float (y)/view.ydim()));
+        for (int x = 0; x < view.xdim(); ++x)
+          view (x,y) = colour;
+      }
+    }
+
+
+
+    void View::write (std::ostream& out, Sixel::Encoder& encoder)
+    {
+      Profile::Timer timer (profiler.get(), Profile::ENCODE);
+      encoder.write (out);
+      encoder_buffer = encoder.release();
+    }
+
+
+
+    void View::plot (std::ostream& out, ImageType& image)
+    {
+      set_axes();
+
+      const int radius = std::max<int>(1, std::round(zoom));
+      const int pad = std::max(radius, std::max<int>(2, std::round(2*zoom)));
+      const int x_dim = std::max(100.0, 2.0f * std::max(std::max (image.size(0)*image.spacing(0), image.size(1)*image.spacing(1)), image.size(2)*image.spacing(2)) * zoom) + 2 * pad;
+      const int y_dim = std::round((float) x_dim / 1.618033) + 2 * pad;
+
+      for (int n = 0; n < 3; ++n)
+        image.index(n) = focus[n];
+
+      ssize_t current_index = image.index (plot_axis);
+      image.index(plot_axis) = 0;
+
+      std::vector<value_type> plotslice (image.size(plot_axis));
+      std::vector<value_type> plotsd;
+      const bool use_roi = plot_roi > 0 && plot_axis > 2;
+      if (use_roi) {
+        if (!roi_stats || !roi_stats->matches (plot_roi, plot_roi_sphere))
+          roi_stats = std::make_shared<ROIStats> (plot_roi, plot_roi_sphere);
+        roi_stats->update (image, plot_axis, focus);
+        plotsd.resize (plotslice.size());
+        for (size_t n = 0; n < plotslice.size(); ++n) {
+          plotslice[n] = roi_stats->mean (n);
+          plotsd[n] = roi_stats->sd (n);
+        }
+      }
+      else if (!(plot_axis > 2 && timeseries && timeseries->get (image, plot_axis, focus, plotslice))) {
+        size_t k = 0;
+        for (auto l = Loop (plot_axis)(image); l; ++l)
+          plotslice[k++] = image.value();
+      }
+      std::vector<value_type> plotslice_finite (plotslice);
+      for (size_t n = 0; n < plotsd.size(); ++n) {
+        plotslice_finite.push_back (plotslice[n] - plotsd[n]);
+        plotslice_finite.push_back (plotslice[n] + plotsd[n]);
+      }
+      value_type vmin = percentile(plotslice_finite, 0); // non-finite values removed
+      value_type vmax = percentile(plotslice_finite, 100);
+      if (vmax == vmin) {
+        vmin -= 1e-3;
+        vmax += 1e-3;
+      }
+
+      if (!plot_cmaps.size())
+        plot_cmaps.add (STATIC_CMAP);
+
+      Sixel::Encoder encoder (x_dim, y_dim, plot_cmaps, std::move (encoder_buffer));
+      auto canvas = encoder.viewport();
+
+      int last_x, last_y;
+      bool connect_dots = false;
+      const int x_offset = pad, y_offset = y_dim-1-pad;
+      // coordinate axes
+      for (int x = 0; x < x_dim; ++x)
+        canvas(x, y_offset) = HIGHLIGHT_COLOUR;
+      for (int y = 0; y < y_dim; ++y)
+        canvas(x_offset, y) = HIGHLIGHT_COLOUR;
+      for (int index = 0; index < int(plotslice.size()); ++index) {
+        int x = std::round(float(index) / (plotslice.size() - 1) * (x_dim - 2 * pad));
+        assert(x < x_dim);
+        assert(x >= 0);
+        int r0 = (index % 10) == 0 ? -pad : -std::max(1, pad/2);
+        for (int y = r0; y < 0; ++y)
+          canvas(x_offset + x, y_offset - y) = HIGHLIGHT_COLOUR;
+      }
+
+      // standard deviation across ROI: draw error bars
+      for (int index = 0; index < int(plotsd.size()); ++index) {
+        if (!std::isfinite (plotslice[index]) || !std::isfinite (plotsd[index]))
+          continue;
+        int x = std::round(float(index) / (plotslice.size() - 1) * (x_dim - 2 * pad));
+        int y0 = std::round(float(plotslice[index] - plotsd[index] - vmin) / (vmax - vmin) * (y_dim - 2 * pad));
+        int y1 = std::round(float(plotslice[index] + plotsd[index] - vmin) / (vmax - vmin) * (y_dim - 2 * pad));
+        for (int y = std::max (y0, 0); y <= std::min (y1, y_dim - 2 * pad); ++y)
+          canvas(x_offset + x, y_offset - y) = STANDARD_COLOUR;
+      }
+
+      for (int index = 0; index < int(plotslice.size()); ++index) {
+        // ignore non-finite point, don't connect neighbouring data
+        if (!std::isfinite(plotslice[index])) {
+          connect_dots = false;
+          continue;
+        }
+        int x = std::round(float(index) / (plotslice.size() - 1) * (x_dim - 2 * pad));
+        int y = std::round(float(plotslice[index] - vmin) / (vmax - vmin) * (y_dim - 2 * pad));
+        assert(x < x_dim);
+        assert(x >= 0);
+        assert(y < y_dim);
+        assert(y >= 0);
+
+        if (crosshair && ((plot_axis < 3 && index == focus[plot_axis]) || (plot_axis > 2 && index == current_index))) {
+          // focus position: draw line
+          for (int r = 0; r < y_offset; ++r)
+            canvas (x_offset+x, r) = CROSSHAIR_COLOUR;
+        }
+
+        // plot line segment
+        if (connect_dots) {
+          assert(x > last_x);
+          const int delta_x = x - last_x;
+          const int delta_y = y - last_y;
+          for (int dx = 0; dx <= delta_x; ++dx) {
+            int dy1 = (dx > 0 ) ? std::round (delta_y*(dx-0.5f)/float(delta_x)) : 0;
+            int dy2 = (dx < delta_x) ? std::round (delta_y*(dx+0.5f)/float(delta_x)) : delta_y;
+            if (dy1 > dy2)
+              std::swap (dy1, dy2);
+            for (int ypos = dy1; ypos <= dy2; ++ypos)
+              canvas (x_offset + last_x + dx, y_offset - (last_y + ypos)) = STANDARD_COLOUR;
+          }
+        }
+
+        // data: draw +
+        for (int r = -radius; r <= radius; ++r)
+          canvas(x_offset + x, y_offset - (y+r)) = HIGHLIGHT_COLOUR;
+        for (int r = -radius; r <= radius; ++r)
+          canvas(x_offset + (x + r), y_offset - y) = HIGHLIGHT_COLOUR;
+
+        connect_dots = true;
+        last_x = x; last_y = y;
+      }
+
+      image.index (plot_axis) = current_index;
+
+      // encode buffer and print out:
+      out << move_down (2);
+      if (show_text) out << CarriageReturn << str(vmax) << move_down(1) << CarriageReturn;
+      write (out, encoder);
+      if (show_text) out << ClearLine << str(vmin)
+        << move_down(1) << CarriageReturn << ClearLine
+        << "plot axis: " << str(plot_axis) << " | x range: [ 0 " << str(plotslice.size() - 1) << " ]";
+      if (use_roi && show_text)
+        out << " | mean \u00B1 SD over " << (plot_roi_sphere ? "sphere" : "cube") << " of radius " << plot_roi
+          << " (" << roi_stats->size() << " voxels)";
+    }
+
+
+
+    // show every lightbox'th slice along the slice axis in a grid of tiles,
+    // including the slice at the focus. Tiles are rendered in parallel:
+    void View::display_lightbox (std::ostream& out, ImageType& image, const Sixel::CMap& cmap, int colourbar_offset)
+    {
+      auto regrid = get_regridder (image, slice_axis);
+      const int x_dim = regrid.size (x_axis);
+      const int y_dim = regrid.size (y_axis);
+
+      vector<int> slices;
+      for (int n = focus[slice_axis] % lightbox; n < image.size (slice_axis); n += lightbox)
+        slices.push_back (n);
+      const int ncols = std::ceil (std::sqrt (float (slices.size())));
+      const int nrows = (slices.size() + ncols - 1) / ncols;
+
+      Sixel::Encoder encoder (colourbar_offset + ncols*x_dim, nrows*y_dim, palette(), std::move (encoder_buffer));
+      if (colorbar && !show_rgb && !show_labels) draw_colourbar (encoder.viewport (0, 0, COLOURBAR_WIDTH), cmap);
+
+      vector<Sixel::ViewPort> tiles;
+      for (size_t n = 0; n < slices.size(); ++n)
+        tiles.push_back (encoder.viewport (colourbar_offset + (n%ncols)*x_dim, (n/ncols)*y_dim, x_dim, y_dim));
+
+      parallel_for (slices.size(), [this,&image,&cmap,&slices,&tiles,regrid] (size_t n) mutable {
+          display_slice (Axes (slice_axis), image, regrid, tiles[n], cmap, slices[n]);
+      });
+
+      const size_t current = focus[slice_axis] / lightbox;
+      if (crosshair)
+        draw_focus (Axes (slice_axis), tiles[current], image, x_dim, y_dim);
+      if (interactive)
+        draw_frame (tiles[current], HIGHLIGHT_COLOUR);
+
+      write (out, encoder);
+    }
+
+
+
+
+    // render the current slice of every volume_grid'th volume into the
+    // thumbnails buffer. Rows are processed in parallel, and all volumes are
+    // sampled at each pixel in turn, so that the slice data are traversed in
+    // a single pass:
+    template <class InterpType>
+    void View::render_thumbnails (InterpType& regrid, const Sixel::CMap& cmap, int nvols)
+    {
+      const int x_dim = regrid.size (x_axis);
+      const int y_dim = regrid.size (y_axis);
+      thumbnails.resize (size_t(nvols)*x_dim*y_dim);
+      uint8_t* data = &thumbnails[0];
+
+      regrid.index (slice_axis) = focus[slice_axis];
+      parallel_for (y_dim, [this,&cmap,data,nvols,x_dim,y_dim,regrid] (size_t y) mutable {
+          regrid.index (y_axis) = y_dim-1-y;
+          for (int x = 0; x < x_dim; ++x) {
+            regrid.index (x_axis) = x_dim-1-x;
+            for (int n = 0; n < nvols; ++n) {
+              regrid.index (vol_axis) = n*volume_grid;
+              data[(size_t(n)*y_dim + y)*x_dim + x] = cmap (regrid.value());
+            }
+          }
+      });
+    }
+
+
+
+
+    // show the current slice of every volume_grid'th volume as a grid of
+    // thumbnails. The thumbnails are kept until the slice or rendering settings
+    // change, so that changing volume only requires moving the highlight:
+    void View::display_volume_grid (std::ostream& out, ImageType& image, const Sixel::CMap& cmap, int colourbar_offset)
+    {
+      auto regrid = get_regridder (image, slice_axis);
+      const int x_dim = regrid.size (x_axis);
+      const int y_dim = regrid.size (y_axis);
+      const int nvols = (image.size (vol_axis) + volume_grid - 1) / volume_grid;
+      const int ncols = std::ceil (std::sqrt (float (nvols)));
+      const int nrows = (nvols + ncols - 1) / ncols;
+
+      std::string key = str(slice_axis) + " " + str(focus[slice_axis]) + " " + str(zoom) + " "
+        + str(vol_axis) + " " + str(volume_grid) + " " + str(int(interpolate)) + " "
+        + str(cmap.offset()) + " " + str(cmap.scale()) + " " + str(cmap.levels());
+      for (size_t n = 3; n < image.ndim(); ++n)
+        if (int(n) != vol_axis)
+          key += " " + str(image.index(n));
+
+      if (key != thumbnails_key) {
+        Profile::Timer timer (profiler.get(), Profile::RENDER);
+        if (interpolate) {
+          LinearReslicer reslicer (image, regrid);
+          render_thumbnails (reslicer, cmap, nvols);
+        }
+        else
+          render_thumbnails (regrid, cmap, nvols);
+        thumbnails_key = key;
+      }
+
+      Sixel::Encoder encoder (colourbar_offset + ncols*x_dim, nrows*y_dim, colourmaps, std::move (encoder_buffer));
+      if (colorbar) draw_colourbar (encoder.viewport (0, 0, COLOURBAR_WIDTH), cmap);
+
+      for (int n = 0; n < nvols; ++n) {
+        auto tile = encoder.viewport (colourbar_offset + (n%ncols)*x_dim, (n/ncols)*y_dim, x_dim, y_dim);
+        const uint8_t* data = &thumbnails[size_t(n)*x_dim*y_dim];
+        for (int y = 0; y < y_dim; ++y)
+          for (int x = 0; x < x_dim; ++x)
+            tile (x,y) = *data++;
+      }
+
+      const int current = image.index (vol_axis) / volume_grid;
+      auto tile = encoder.viewport (colourbar_offset + (current%ncols)*x_dim, (current/ncols)*y_dim, x_dim, y_dim);
+      if (crosshair)
+        draw_focus (Axes (slice_axis), tile, image, x_dim, y_dim);
+      if (interactive)
+        draw_frame (tile, HIGHLIGHT_COLOUR);
+
+      write (out, encoder);
+    }
+
+
+
+
+    void View::display_image (std::ostream& out, ImageType& image, const Sixel::CMap& cmap, int colourbar_offset)
+    {
+      if (volume_grid > 0 && vol_axis >= 0) {
+        display_volume_grid (out, image, cmap, colourbar_offset);
+        return;
+      }
+
+      if (lightbox > 0) {
+        display_lightbox (out, image, cmap, colourbar_offset);
+        return;
+      }
+
+      if (orthoview) {
+        ImageType source[3];
+        int slice[3];
+        for (int axis = 0; axis < 3; ++axis)
+          slice[axis] = get_source (image, axis, source[axis]);
+
+        // limit each panel to a third of the window width:
+        if (max_width > 0 && max_height > 0) {
+          const int panel_width = std::max ((max_width - colourbar_offset) / 3, 1);
+          extent[0] = panel_width;
+          extent[1] = std::min (panel_width, max_height);
+          extent[2] = max_height;
+        }
+
+        Reslicer regrid[3] = {
+          get_regridder (source[0], 0, true),
+          get_regridder (source[1], 1, true),
+          get_regridder (source[2], 2, true)
+        };
+
+        // set up canvas:
+        const int panel_y_dim = std::max(regrid[0].size(2), regrid[2].size(1));
+        Sixel::Encoder encoder (colourbar_offset + regrid[0].size(1)+regrid[1].size(0)+regrid[2].size(0),
+            panel_y_dim, palette(), std::move (encoder_buffer));
+
+        // the panels (and the colourbar) occupy disjoint regions of the
+        // canvas, so are rendered concurrently, each with its own axes:
+        Sixel::ViewPort panels[3] = {
+          encoder.viewport (colourbar_offset, 0, regrid[0].size(1), panel_y_dim),
+          encoder.viewport (colourbar_offset + regrid[0].size(1), 0, regrid[1].size(0), panel_y_dim),
+          encoder.viewport (colourbar_offset + regrid[0].size(1) + regrid[1].size(0), 0, regrid[2].size(0), panel_y_dim)
+        };
+        auto colourbar_view = encoder.viewport (0, 0, COLOURBAR_WIDTH);
+
+        parallel_for (4, [&] (size_t n) {
+            if (n == 3) {
+              if (colorbar && !show_rgb && !show_labels)
+                draw_colourbar (colourbar_view, cmap);
+              return;
+            }
+            const Axes axes (n);
+            const int x_dim = regrid[n].size (axes.x);
+            const int y_dim = regrid[n].size (axes.y);
+            // recentring
+            const int dy = (panel_y_dim - y_dim) / 2;
+            const auto& view = panels[n];
+            const bool tilted = oblique() && projection == PROJECTION_NONE && int(n) == slice_axis;
+            const value_type* overlay_slice = get_overlay (axes, image, regrid[n], tilted);
+            if (tilted)
+              display_oblique (axes, source[n], regrid[n], view.viewport (0, dy), cmap, slice[n], overlay_slice);
+            else
+              display_slice (axes, source[n], regrid[n], view.viewport (0, dy), cmap, slice[n], overlay_slice);
+
+            if (crosshair)
+              draw_focus (axes, view, image, x_dim, y_dim, dy);
+
+            if (interactive && int(n) == slice_axis)
+              draw_frame (view, HIGHLIGHT_COLOUR);
+        });
+
+        // encode buffer and print out:
+        write (out, encoder);
+      }
+      else {
+        ImageType source;
+        const int slice = get_source (image, slice_axis, source);
+        if (max_width > 0 && max_height > 0) {
+          extent[x_axis] = std::max (max_width - colourbar_offset, 1);
+          extent[y_axis] = max_height;
+        }
+        auto regrid = get_regridder (source, slice_axis, true);
+        const int x_dim = regrid.size (x_axis);
+        const int y_dim = regrid.size (y_axis);
+
+        Sixel::Encoder encoder (colourbar_offset+x_dim, y_dim, palette(), std::move (encoder_buffer));
+        if (colorbar && !show_rgb && !show_labels) draw_colourbar (encoder.viewport (0, 0, COLOURBAR_WIDTH), cmap);
+
+        auto view = encoder.viewport(colourbar_offset, 0);
+        const bool tilted = oblique() && projection == PROJECTION_NONE;
+        const Axes axes (slice_axis);
+        const value_type* overlay_slice = get_overlay (axes, image, regrid, tilted);
+        if (tilted)
+          display_oblique (axes, source, regrid, view, cmap, slice, overlay_slice);
+        else
+          display_slice (axes, source, regrid, view, cmap, slice, overlay_slice);
+
+        if (crosshair)
+          draw_focus (axes, view, image, x_dim, y_dim);
+
+        //view.draw_colourbar ();
+
+        // encode buffer and print out:
+        write (out, encoder);
+      }
+    }
+
+
+
+
+
+
+    void View::display (std::ostream& out, ImageType& image)
+    {
+      auto& cmap = colourmaps[1];
+      projection_pending = false;
+
+      // temporal statistics replace the current volume for display (but not for plots):
+      ImageType shown (image);
+      const bool show_temporal = temporal != TEMPORAL_NONE && vol_axis >= 0 && !volume_grid;
+      if (show_temporal) {
+        if (!temporal_stats)
+          temporal_stats = std::make_shared<TemporalStats>();
+        shown = temporal_stats->get (image, vol_axis, temporal, interactive && background);
+      }
+      temporal_pending = show_temporal && temporal_stats->processed() < temporal_stats->size();
+
+      show_labels = labels_mode != LABELS_NONE && !volume_grid;
+      show_rgb = rgb && !show_labels && vol_axis >= 0 && int(shown.ndim()) > vol_axis && shown.size (vol_axis) >= 3
+        && !volume_grid && projection == PROJECTION_NONE;
+      if (show_rgb || show_labels)
+        set_fixed_palette();
+
+      if (show_image) {
+        set_axes();
+        for (int n = 0; n < 3; ++n) {
+          if (focus[n] < 0) focus[n] = 0;
+          if (focus[n] >= image.size(n)) focus[n] = image.size(n)-1;
+        }
+
+        if (!cmap.scaling_set() || rescale_pending)
+          autoscale (shown, cmap);
+        if (show_text) {
+          out << ClearLine;
+          if (arrow_mode == ARROW_COLOUR)
+            out << TextForegroundYellow;
+          out << str(cmap.max(),4) << TextReset << move_down(1) << position_cursor_at_col (2);
+        }
+
+        display_image (out, shown, cmap, 2*COLOURBAR_WIDTH);
+        out << CarriageReturn << ClearLine;
+
+        if (show_text) {
+          if (arrow_mode == ARROW_COLOUR)
+            out << TextForegroundYellow;
+          out << str(cmap.min(), 4) << TextReset << move_down(1) << CarriageReturn;
+        }
+      }
+
+
+      if (show_text) out << show_focus(shown);
+
+      if (caption.size() && show_text)
+        out << " | " << caption;
+
+      if (show_rgb && show_text)
+        out << " | RGB";
+
+      if (show_labels && show_text)
+        out << " | labels" << (labels_mode == LABELS_OUTLINE ? " (outline)" : "");
+
+      if (overlay.valid() && show_text) {
+        Interp::Nearest<ImageType> interp (overlay, NaN);
+        interp.scanner (focus_position (image));
+        out << " | overlay: " << str(interp.value());
+      }
+
+      if (show_temporal && show_text) {
+        out << " | temporal " << temporal_stat_choices[temporal];
+        if (temporal_pending)
+          out << " (" << temporal_stats->processed() << " of " << temporal_stats->size() << " volumes)";
+      }
+
+      if (volume_grid > 0 && vol_axis >= 0 && show_text)
+        out << " | volume grid: every " << volume_grid << (volume_grid > 1 ? " volumes" : " volume");
+      else if (lightbox > 0 && show_text)
+        out << " | lightbox: every " << lightbox << (lightbox > 1 ? " slices" : " slice");
+      else if (projection != PROJECTION_NONE && show_image && show_text)
+        out << " | " << projection_names[projection] << " intensity projection" << (projection_pending ? " (computing...)" : "");
+      else if (oblique() && show_image && show_text)
+        out << " | oblique: [ " << str(tilt[0] * 180.0 / Math::pi, 3) << " " << str(tilt[1] * 180.0 / Math::pi, 3) << " ] deg";
+
+      if (interactive && orthoview && !lightbox && !(volume_grid && vol_axis >= 0) && show_text) {
+        out << " | active: ";
+        switch (slice_axis) {
+          case (0): out << TextUnderscore << "s" << TextReset << "agittal"; break;
+          case (1): out << TextUnderscore << "c" << TextReset << "oronal"; break;
+          case (2): out << TextUnderscore << "a" << TextReset << "xial"; break;
+          default: break;
+        };
+      }
+
+      if (show_profile && profiler && show_text)
+        out << " | " << profiler->summary();
+
+      if (interactive && show_text)
+        out << " | help: " << TextUnderscore << "?" << TextReset;
+      if (do_plot)
+        plot (out, image);
+    }
+
+  }
+}
+
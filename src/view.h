@@ -0,0 +1,207 @@
+#ifndef __VIEW_H__
+#define __VIEW_H__
+
+#include <memory>
+#include "image.h"
+#include "interp/nearest.h"
+#include "interp/linear.h"
+#include "interp/cubic.h"
+#include "filter/reslice.h"
+
+#include "profile.h"
+#include "sixel.h"
+
+#define DEFAULT_PMIN 0.2
+#define DEFAULT_PMAX 99.8
+
+#define CROSSHAIR_COLOUR 1
+#define STANDARD_COLOUR 2
+#define HIGHLIGHT_COLOUR 3
+#define STATIC_CMAP { {0,0,0}, { 50,50,0 }, {50,50,50}, {100,100,100} }
+
+// the largest number of colourmap levels, without and with an overlay: the
+// static colours take indices 0-4, the main colourmap 5 to 5+levels, and the
+// overlay colourmap the next levels+1 indices, all of which must fit within
+// the 256 colour registers of a frame:
+#define MAX_LEVELS 250
+#define MAX_OVERLAY_LEVELS 124
+
+#define COLOURBAR_WIDTH 10
+
+
+// Rendering of an image to a sixel stream, independently of the command
+// line interface. All display settings are held by a View, which renders
+// the image passed to display() into the supplied stream, and keeps the
+// data derived from the image (intensity projections, temporal statistics,
+// resampled overlays, ...) along with its drawing buffers for reuse on the
+// next call.
+
+namespace MR {
+  namespace Render {
+
+    enum ArrowMode { ARROW_SLICEVOL, ARROW_COLOUR, ARROW_CROSSHAIR, N_ARROW_MODES };
+    enum ProjectionMode { PROJECTION_NONE, PROJECTION_MAX, PROJECTION_MIN, PROJECTION_MEAN, N_PROJECTION_MODES };
+    extern const char* projection_modes[];
+    extern const char* projection_names[];
+    enum TemporalStat { TEMPORAL_NONE, TEMPORAL_MEAN, TEMPORAL_STD, TEMPORAL_TSNR, N_TEMPORAL_STATS };
+    extern const char* temporal_stat_choices[];
+    enum LabelsMode { LABELS_NONE, LABELS_FILL, LABELS_OUTLINE, N_LABELS_MODES };
+    extern const char* labels_mode_choices[];
+
+    using value_type = float;
+    using ImageType = Image<value_type>;
+    using Reslicer = Adapter::Reslice<Interp::Nearest, ImageType>;
+    using LinearReslicer = Adapter::Reslice<Interp::Linear, ImageType>;
+    using CubicReslicer = Adapter::Reslice<Interp::Cubic, ImageType>;
+
+    // caches of data derived from the image, defined in view.cpp:
+    class TimeSeriesCache;
+    class ROIStats;
+    class ProjectionCache;
+    class TemporalStats;
+
+
+
+    // Display parameters for a single view of an image, along with the
+    // functions to render it. Each instance holds its own state, so that
+    // independent views can be rendered concurrently:
+    class View
+    {
+      public:
+        int levels = 32;
+        int x_axis = 0, y_axis = 1, slice_axis = 2, plot_axis = 2, vol_axis = -1;
+        value_type pmin = DEFAULT_PMIN, pmax = DEFAULT_PMAX, zoom = 1.0;
+        bool crosshair = true, colorbar = true, orthoview = true, interactive = true;
+        bool background = true;  // when interactive, compute projections & temporal statistics in the background
+        bool do_plot = false, show_image = true, interpolate = false, show_text = true;
+        int lightbox = 0;  // spacing between slices shown in lightbox mode; 0 if disabled
+        int volume_grid = 0;  // spacing between volumes shown in volume grid mode; 0 if disabled
+        ProjectionMode projection = PROJECTION_NONE;
+        float tilt[2] = { 0.0f, 0.0f };  // rotation of the slicing plane about its x & y axes, in radians
+        int max_width = 0, max_height = 0;  // size of the visible window in pixels; 0 if unlimited
+        TemporalStat temporal = TEMPORAL_NONE;  // temporal statistic shown instead of the current volume
+        vector<int> focus = vector<int> (3, 0);  // relative to original image grid
+        ArrowMode x_arrow_mode = ARROW_SLICEVOL, arrow_mode = ARROW_SLICEVOL;
+        Sixel::ColourMaps colourmaps;
+        Sixel::ColourMaps plot_cmaps;
+        std::shared_ptr<TimeSeriesCache> timeseries;  // only used if set
+        int plot_roi = 0;  // radius of ROI averaged over for plots along the volume axis; 0 if disabled
+        bool plot_roi_sphere = false;
+        std::shared_ptr<ROIStats> roi_stats;
+        std::shared_ptr<ProjectionCache> projections;  // created on first use
+        std::shared_ptr<TemporalStats> temporal_stats;  // created on first use
+        ImageType overlay;  // only used if valid
+        bool rgb = false;  // show first three volumes as red, green & blue
+        LabelsMode labels_mode = LABELS_NONE;  // show image as integer labels
+        value_type overlay_threshold = 0.0;  // overlay only shown where above threshold
+        std::string caption;  // shown in the status line if set
+        float frame_rate = 10.0f;  // for cine playback
+        std::shared_ptr<Profile::Profiler> profiler;  // timings of the rendering stages, only recorded if set
+        bool show_profile = false;  // show the timings of the last frame in the status line
+
+        void set_axes ();
+        void autoscale (ImageType& image, Sixel::CMap& cmap);
+
+        // Show the main image,
+        // run repeatedly to update display.
+        // Output is streamed to 'out' as it is produced.
+        void display (std::ostream& out, ImageType& image);
+
+        std::string show_focus (ImageType& image);
+
+        bool oblique () const { return tilt[0] || tilt[1]; }
+
+        void set_levels (int n);
+        void set_overlay (ImageType& image, value_type threshold, int colourmap_ID);
+
+        // cache time series around the focus for plots along the volume axis:
+        void cache_timeseries ();
+        // discard all data derived from the image, e.g. once it has been modified:
+        void clear_caches ();
+        // memory held by the data derived from the image, in bytes:
+        size_t cache_bytes () const;
+
+        // carry the view over from image 'from' to image 'to':
+        void switch_image (const ImageType& from, ImageType& to);
+        // all settings that affect the output of display() for 'image':
+        std::string state_key (const ImageType& image) const;
+        // checksum of the voxel data of 'image' that display() depends on:
+        uint64_t checksum (ImageType& image) const;
+        // whether the last call to display() rendered everything requested:
+        bool complete () const { return !projection_pending && !temporal_pending && !rescale_pending; }
+
+      private:
+        bool projection_pending = false;  // projection requested but not yet available
+        bool temporal_pending = false;  // temporal statistics pass not yet complete
+        bool rescale_pending = false;  // scaling computed from incomplete data, to be updated
+
+        // maximum number of pixels rendered along each axis (0 if unlimited),
+        // and the offset of the rendered region along each axis:
+        int extent[3] = { 0, 0, 0 };
+        int pan[3] = { 0, 0, 0 };
+
+        // the in-plane axes of a slice along the given axis, for rendering
+        // panels of different orientations independently of 'slice_axis':
+        struct Axes {
+          Axes (int slice) : slice (slice), x (slice == 0 ? 1 : 0), y (slice == 2 ? 1 : 2) { }
+          int slice, x, y;
+        };
+
+        std::string move_down (int n) const;
+        Reslicer get_regridder (ImageType& image, int with_slice_axis, bool crop = false);
+        int get_source (ImageType& image, int axis, ImageType& source);
+        template <class InterpType>
+          void render_slice (const Axes& axes, InterpType& regrid, const Sixel::ViewPort& view, const Sixel::CMap& cmap, int slice, const value_type* overlay = nullptr) const;
+        void display_slice (const Axes& axes, const ImageType& image, Reslicer& regrid, const Sixel::ViewPort& view, const Sixel::CMap& cmap, int slice, const value_type* overlay = nullptr) const;
+        template <class InterpType, class Functor>
+          void sample_plane (const Axes& axes, InterpType& interp, const Reslicer& regrid, const Eigen::Vector3d& centre, bool tilted, int slice, Functor&& functor) const;
+        Eigen::Vector3d focus_position (const ImageType& image) const;
+        template <class InterpType>
+          void render_oblique (const Axes& axes, InterpType& interp, const Reslicer& regrid, const Eigen::Vector3d& centre,
+              const Sixel::ViewPort& view, const Sixel::CMap& cmap, int slice, const value_type* overlay) const;
+        void display_oblique (const Axes& axes, const ImageType& image, const Reslicer& regrid, const Sixel::ViewPort& view, const Sixel::CMap& cmap, int slice, const value_type* overlay) const;
+
+        // true colour and label display use a fixed palette holding the static
+        // colours, followed by a colour cube of rgb_levels^3 entries or by
+        // num_label_colours distinct colours, then the overlay colourmap (if any):
+        bool show_rgb = false, show_labels = false;
+        int rgb_levels = 0, num_label_colours = 0, fixed_first = 0;
+        bool rgb_dither = true;
+        std::string fixed_palette_key;
+        Sixel::ColourMaps fixed_colourmaps;
+        void set_fixed_palette ();
+        const Sixel::ColourMaps& palette () const { return show_rgb || show_labels ? fixed_colourmaps : colourmaps; }
+        const Sixel::CMap& overlay_cmap () const { return show_rgb || show_labels ? fixed_colourmaps[1] : colourmaps[2]; }
+        template <class ImageType>
+          uint8_t rgb_colour (ImageType& in, const Sixel::CMap& cmap, int x, int y) const;
+        uint8_t label_colour (int32_t label) const;
+        void display_labels (const Axes& axes, const ImageType& image, const Reslicer& regrid, const Sixel::ViewPort& view, int slice, bool tilted, const value_type* overlay) const;
+
+        // overlay resampled onto the current slice for each orientation, along
+        // with the slice geometry it was resampled for:
+        std::string overlay_keys[3];
+        vector<value_type> overlay_slices[3];
+        const value_type* get_overlay (const Axes& axes, const ImageType& image, const Reslicer& regrid, bool tilted);
+        void draw_focus (const Axes& axes, const Sixel::ViewPort& view, const ImageType& image, int x_dim, int y_dim, int dy = 0) const;
+        void display_lightbox (std::ostream& out, ImageType& image, const Sixel::CMap& cmap, int colourbar_offset);
+        template <class InterpType>
+          void render_thumbnails (InterpType& regrid, const Sixel::CMap& cmap, int nvols);
+        void display_volume_grid (std::ostream& out, ImageType& image, const Sixel::CMap& cmap, int colourbar_offset);
+
+        // storage for the canvas of the sixel encoder, reused between frames:
+        vector<uint8_t> encoder_buffer;
+        // encode the canvas to 'out', keeping its storage for the next frame:
+        void write (std::ostream& out, Sixel::Encoder& encoder);
+
+        // thumbnails for volume grid mode, along with the settings they were rendered with:
+        std::string thumbnails_key;
+        vector<uint8_t> thumbnails;
+        void plot (std::ostream& out, ImageType& image);
+        void display_image (std::ostream& out, ImageType& image, const Sixel::CMap& cmap, int colourbar_offset);
+    };
+
+  }
+}
+
+#endif
+
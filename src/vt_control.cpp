@@ -1,10 +1,15 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <unistd.h>
 #include <thread>
 
 #ifndef MRTRIX_WINDOWS
 # include <termios.h>
 # include <poll.h>
+# include <fcntl.h>
 #endif
 
 
@@ -30,31 +35,105 @@ namespace MR {
     namespace {
 #ifndef MRTRIX_WINDOWS
       struct termios orig_termios;
+
+      // self-pipe used to wake up the event loop from other threads:
+      const int* wakeup_pipe ()
+      {
+        static int fds[2] = { -1, -1 };
+        static bool initialised = [] {
+          if (pipe (fds))
+            throw Exception ("error creating wake-up pipe for event loop");
+          for (int n = 0; n < 2; ++n)
+            fcntl (fds[n], F_SETFL, fcntl (fds[n], F_GETFL) | O_NONBLOCK);
+          return true;
+        } ();
+        (void) initialised;
+        return fds;
+      }
 #endif
+
+      using clock = std::chrono::steady_clock;
+      constexpr const char* RecordingHeader = "mrpeek input recording";
+
+      // input being recorded, as one line per read holding the time at which
+      // it completed (in microseconds), followed by the bytes read in hex:
+      struct Recording {
+        std::ofstream out;
+        clock::time_point start;
+      };
+      std::unique_ptr<Recording> recording;
+
+      void record (const uint8_t* data, int size)
+      {
+        static const char* digits = "0123456789abcdef";
+        auto& out = recording->out;
+        out << std::chrono::duration_cast<std::chrono::microseconds> (clock::now() - recording->start).count() << " ";
+        for (int n = 0; n < size; ++n)
+          out << digits[data[n] >> 4] << digits[data[n] & 0x0F];
+        out << "\n";
+        out.flush();
+      }
+
+      int hex_value (char c)
+      {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+      }
+
+      // stands in for the terminal while replaying, discarding all output:
+      class NullTerminal : public std::streambuf
+      {
+        public:
+          size_t count = 0;
+        protected:
+          int overflow (int c) override {
+            if (c != EOF)
+              ++count;
+            return c;
+          }
+          std::streamsize xsputn (const char*, std::streamsize n) override {
+            count += n;
+            return n;
+          }
+      };
+
+      struct Replay {
+        vector<std::string> reads;
+        size_t next = 0;
+        bool pending = false;  // whether the last read delivered is yet to be processed
+        clock::time_point delivered;
+        ReplayStats stats;
+        NullTerminal terminal;
+        std::streambuf* output = nullptr;
+      };
+      std::unique_ptr<Replay> replay;
     }
 
 
     void enter_raw_mode ()
     {
 #ifndef MRTRIX_WINDOWS
-      if (!isatty (STDOUT_FILENO))
-        if (!freopen ("/dev/tty", "a", stdout))
-          throw Exception ("failed to remap stdout to the terminal");
-
-      if (!isatty (STDIN_FILENO))
-        if (!freopen ("/dev/tty", "r", stdin))
-          throw Exception ("failed to remap stdin to the terminal");
-
-      // enable raw mode:
-      struct termios raw;
-      tcgetattr(STDIN_FILENO, &raw);
-      orig_termios = raw;
-      raw.c_iflag &= ~(ICRNL | IXON);
-      raw.c_oflag &= ~(OPOST);
-      raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-      raw.c_cc[VMIN] = 0;
-      raw.c_cc[VTIME] = 0;
-      tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+      if (!replay) {
+        if (!isatty (STDOUT_FILENO))
+          if (!freopen ("/dev/tty", "a", stdout))
+            throw Exception ("failed to remap stdout to the terminal");
+
+        if (!isatty (STDIN_FILENO))
+          if (!freopen ("/dev/tty", "r", stdin))
+            throw Exception ("failed to remap stdin to the terminal");
+
+        // enable raw mode:
+        struct termios raw;
+        tcgetattr(STDIN_FILENO, &raw);
+        orig_termios = raw;
+        raw.c_iflag &= ~(ICRNL | IXON);
+        raw.c_oflag &= ~(OPOST);
+        raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+      }
 #endif
 
       std::cout << CursorOff << MouseTrackingOn;
@@ -62,10 +141,22 @@ namespace MR {
     }
 
 
+    void wake_event_loop ()
+    {
+#ifndef MRTRIX_WINDOWS
+      const char c = 0;
+      // nothing to do if pipe is full: loop will be woken up anyway
+      if (write (wakeup_pipe()[1], &c, 1)) { }
+#endif
+    }
+
+
+
     void exit_raw_mode ()
     {
 #ifndef MRTRIX_WINDOWS
-      tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+      if (!replay)
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
 #endif
       std::cout << CursorOn << MouseTrackingOff << "\n";
       std::cout.flush();
@@ -78,6 +169,74 @@ namespace MR {
 
 
 
+    void record_input (const std::string& path)
+    {
+      std::unique_ptr<Recording> r (new Recording);
+      r->out.open (path, std::ios::out | std::ios::binary);
+      if (!r->out)
+        throw Exception ("error opening file \"" + path + "\" to record input");
+      r->out << RecordingHeader << "\n";
+      r->start = clock::now();
+      recording = std::move (r);
+    }
+
+
+
+    void replay_input (const std::string& path)
+    {
+      std::ifstream in (path, std::ios::in | std::ios::binary);
+      if (!in)
+        throw Exception ("error opening input recording \"" + path + "\"");
+      std::string line;
+      if (!std::getline (in, line) || line != RecordingHeader)
+        throw Exception ("file \"" + path + "\" is not an mrpeek input recording");
+
+      std::unique_ptr<Replay> r (new Replay);
+      while (std::getline (in, line)) {
+        const size_t start = line.find (' ') + 1;
+        const size_t size = (line.size() - start) / 2;
+        if (!start || !size || size > VT_READ_BUFSIZE || (line.size() - start) % 2)
+          throw Exception ("malformed input recording \"" + path + "\"");
+        std::string data;
+        for (size_t n = 0; n < size; ++n) {
+          const int high = hex_value (line[start+2*n]), low = hex_value (line[start+2*n+1]);
+          if (high < 0 || low < 0)
+            throw Exception ("malformed input recording \"" + path + "\"");
+          data.push_back (char (16*high + low));
+        }
+        r->reads.push_back (data);
+      }
+
+      r->output = std::cout.rdbuf (&r->terminal);
+      replay = std::move (r);
+    }
+
+
+
+    bool replaying ()
+    {
+      return bool (replay);
+    }
+
+
+
+    ReplayStats end_replay ()
+    {
+      std::cout.flush();
+      std::cout.rdbuf (replay->output);
+      ReplayStats stats = replay->stats;
+      stats.bytes = replay->terminal.count;
+      replay.reset();
+      return stats;
+    }
+
+
+
+
+
+
+
+
     void EventLoop::run ()
     {
       while (true) {
@@ -192,24 +351,64 @@ namespace MR {
     {
       current_char = 0;
 
+      if (replay) {
+        // all input delivered so far has been processed, as for a terminal
+        // with no input pending:
+        callback (0, param);
+        if (replay->pending) {
+          replay->stats.latencies.push_back (std::chrono::duration<double> (clock::now() - replay->delivered).count());
+          replay->pending = false;
+        }
 #ifndef MRTRIX_WINDOWS
-      struct pollfd pfd;
-      pfd.fd = STDIN_FILENO;
-      pfd.events = POLLIN;
+        char drain[64];
+        if (callback.wake_up && read (wakeup_pipe()[0], drain, sizeof(drain)) > 0) {
+          while (read (wakeup_pipe()[0], drain, sizeof(drain)) > 0);
+          callback (WakeUp, param);
+          callback (0, param);
+        }
+#endif
+        if (replay->next >= replay->reads.size())
+          throw Exception ("end of recorded input reached");
+        const std::string& data = replay->reads[replay->next++];
+        memcpy (buf, data.data(), data.size());
+        nread = data.size();
+        replay->pending = true;
+        replay->delivered = clock::now();
+        return;
+      }
+
+#ifndef MRTRIX_WINDOWS
+      struct pollfd pfd[2];
+      pfd[0].fd = STDIN_FILENO;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = wakeup_pipe()[0];
+      pfd[1].events = POLLIN;
 
       // if nothing on input stream, invoke idle event:
-      poll (&pfd, 1, 0);
-      if (!pfd.revents)
+      poll (pfd, 1, 0);
+      if (!pfd[0].revents)
         callback (0, param);
 
+      nread = 0;
       do {
-        poll (&pfd, 1, -1);
-        if (pfd.revents != POLLIN)
+        poll (pfd, callback.wake_up ? 2 : 1, -1);
+        if (callback.wake_up && (pfd[1].revents & POLLIN)) {
+          char drain[64];
+          while (read (pfd[1].fd, drain, sizeof(drain)) > 0);
+          callback (WakeUp, param);
+          if (!pfd[0].revents) {
+            callback (0, param);
+            continue;
+          }
+        }
+        if (pfd[0].revents != POLLIN)
           throw Exception ("unexpected error on input stream");
         nread = read (STDIN_FILENO, buf, VT_READ_BUFSIZE);
         if (nread == -1 && errno != EAGAIN)
           throw Exception ("error reading user input");
-      } while (nread == 0);
+        if (nread > 0 && recording)
+          record (buf, nread);
+      } while (nread <= 0);
 #endif
     }
 
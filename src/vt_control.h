@@ -32,6 +32,9 @@ namespace MR {
 
     constexpr const char* RequestCursorPosition = "\x1b[6n";
     constexpr const char* QueryIsSixelSupported = "\x1b[c";
+    constexpr const char* RequestWindowSizePixels = "\x1b[14t";
+    constexpr const char* RequestCellSizePixels = "\x1b[16t";
+    constexpr const char* RequestWindowSizeChars = "\x1b[18t";
 
     constexpr char Escape = '\x1b';
     constexpr char CtrlC = '\x03';
@@ -44,6 +47,7 @@ namespace MR {
     constexpr int CSImask = 0x0100;
     constexpr int MouseEvent = 0x1000;
     constexpr int FunctionKey = 0x2000;
+    constexpr int WakeUp = 0x4000;
 
     enum MouseButton {
       MouseLeft, MouseMiddle, MouseRight,
@@ -92,6 +96,35 @@ namespace MR {
     void enter_raw_mode();
     void exit_raw_mode();
 
+    // interrupt the running EventLoop from another thread, e.g. once a
+    // background computation has completed. If the loop's callback accepts
+    // wake-ups, it receives a WakeUp event, followed by an idle event if no
+    // input is pending; otherwise, the wake-up is held back until a loop
+    // whose callback does accept them runs again.
+    void wake_event_loop ();
+
+    // record all input subsequently read by EventLoops (including the
+    // terminal's responses to queries) to 'path', along with the time at
+    // which it was received:
+    void record_input (const std::string& path);
+
+    // read the input of EventLoops from a file written by record_input()
+    // rather than from the terminal, and discard all output to std::cout, so
+    // that a recorded session can be reproduced without a terminal. Recorded
+    // input is delivered one read at a time, as soon as the previous one has
+    // been processed, and the time taken to process each (up to the end of
+    // the display update that follows it) is measured. Raw mode is not
+    // entered while replaying:
+    void replay_input (const std::string& path);
+    bool replaying ();
+
+    struct ReplayStats {
+      vector<double> latencies;  // in seconds, for each read replayed
+      size_t bytes;  // output discarded
+    };
+    // end the replay, restoring output to std::cout:
+    ReplayStats end_replay ();
+
 
 
     class EventLoop
@@ -99,7 +132,10 @@ namespace MR {
       public:
         class CallBack {
           public:
+            CallBack (bool wake_up = false) : wake_up (wake_up) { }
             virtual bool operator() (int event, const std::vector<int>& param) = 0;
+            // whether WakeUp events are delivered to this callback:
+            const bool wake_up;
         };
 
 